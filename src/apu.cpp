@@ -0,0 +1,763 @@
+#include "apu.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "gameboy.h"
+
+static constexpr uint8_t duty_patterns[] = {0b00000001, 0b10000001, 0b10000111, 0b01111110};
+
+// Bits that read back as 1, from NR10 to 0xff2f
+static constexpr uint8_t read_masks[] = {
+    0x80, 0x3f, 0x00, 0xff, 0xbf, // NR10-NR14
+    0xff, 0x3f, 0x00, 0xff, 0xbf, // NR21-NR24
+    0x7f, 0xff, 0x9f, 0xff, 0xbf, // NR30-NR34
+    0xff, 0xff, 0x00, 0x00, 0xbf, // NR41-NR44
+    0x00, 0x00, 0x70, 0xff, 0xff, // NR50-NR52
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+// Register values after the boot ROM, from NR10 to NR51
+static constexpr uint8_t boot_regs[] = {
+    0x80, 0xbf, 0xf3, 0xff, 0xbf, 0x00, 0x3f, 0x00, 0xff, 0xbf, 0x7f,
+    0xff, 0x9f, 0xff, 0xbf, 0x00, 0xff, 0x00, 0x00, 0xbf, 0x77, 0xf3,
+};
+
+static uint32_t square_period(uint16_t frequency)
+{
+    return (2048 - frequency) * 4;
+}
+
+static uint32_t wave_period(uint16_t frequency)
+{
+    return (2048 - frequency) * 2;
+}
+
+// 0 when the shift stops the LFSR
+static uint32_t noise_period(uint8_t nr43)
+{
+    uint32_t shift = nr43 >> 4;
+    uint32_t divisor = nr43 & 7;
+    return shift >= 14 ? 0 : (divisor ? divisor * 16 : 8) << shift;
+}
+
+static int32_t mix_gain(uint8_t nr50, uint8_t nr51, size_t index, size_t side)
+{
+    size_t shift = side == 0 ? 4 : 0;
+    return bit(nr51, index + shift) ? ((nr50 >> shift) & 7) + 1 : 0;
+}
+
+void Channel::clock_length()
+{
+    if (length_enabled && length > 0 && --length == 0)
+    {
+        enabled = false;
+    }
+}
+
+void Envelope::trigger(uint8_t nrx2)
+{
+    volume = nrx2 >> 4;
+    timer = nrx2 & 7;
+}
+
+void Envelope::step(uint8_t nrx2)
+{
+    uint8_t period = nrx2 & 7;
+    if (period == 0)
+    {
+        return;
+    }
+    if (timer > 0 && --timer > 0)
+    {
+        return;
+    }
+    timer = period;
+    if (bit(nrx2, 3) && volume < 15)
+    {
+        volume += 1;
+    }
+    else if (!bit(nrx2, 3) && volume > 0)
+    {
+        volume -= 1;
+    }
+}
+
+void APU::reset(Gameboy& gb)
+{
+    uint64_t now = gb.scheduler.now;
+    square1 = {};
+    square2 = {};
+    wave = {};
+    noise = {};
+    memset(regs, 0, sizeof(regs));
+    memcpy(regs, boot_regs, sizeof(boot_regs));
+    memset(wave_ram, 0, sizeof(wave_ram));
+    power = true;
+    frame_step = 0;
+    last_time = now;
+    buffer.reset(buffer.rate, now);
+
+    // The boot sound leaves channel 1 enabled with its envelope down to 0
+    square1.enabled = true;
+    square1.dac = reg(NR12) & 0xf8;
+    square1.frequency = reg(NR13) | ((reg(NR14) & 7) << 8);
+    square1.period = square_period(square1.frequency);
+    square1.next = now + square1.period;
+    square2.period = square_period(0);
+    square2.next = now + square2.period;
+    wave.period = wave_period(0);
+    wave.next = now + wave.period;
+    noise.next = NEVER;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        update_level(i, now);
+    }
+    schedule_frame_step(gb);
+}
+
+uint8_t APU::read(Gameboy& gb, uint16_t addr)
+{
+    if (addr >= WAVE_BEGIN)
+    {
+        return wave_ram[addr - WAVE_BEGIN];
+    }
+    if (addr == NR52)
+    {
+        // The status bits depend on the length counters
+        catch_up(gb);
+        return (power << 7) | 0x70 | (noise.enabled << 3) | (wave.enabled << 2) | (square2.enabled << 1)
+               | square1.enabled;
+    }
+    return reg(addr) | read_masks[addr - NR10];
+}
+
+void APU::write(Gameboy& gb, uint16_t addr, uint8_t value)
+{
+    catch_up(gb);
+    uint64_t now = gb.scheduler.now;
+
+    if (addr >= WAVE_BEGIN)
+    {
+        wave_ram[addr - WAVE_BEGIN] = value;
+        return;
+    }
+    if (addr == NR52)
+    {
+        if (power && !bit(value, 7))
+        {
+            power_off(now);
+        }
+        else if (!power && bit(value, 7))
+        {
+            power = true;
+            frame_step = 0;
+            square1.position = 0;
+            square2.position = 0;
+        }
+        schedule_frame_step(gb);
+        return;
+    }
+    if (!power)
+    {
+        // The DMG length counters stay writable while the APU is off
+        if (!gb.memory.cgb && (addr == NR11 || addr == NR21 || addr == NR31 || addr == NR41))
+        {
+            write_length(addr, value);
+        }
+        return;
+    }
+
+    uint8_t old = reg(addr);
+    reg(addr) = value;
+    switch (addr)
+    {
+    case NR11:
+    case NR21:
+    case NR31:
+    case NR41:
+        write_length(addr, value);
+        update_level(addr == NR11 ? 0 : addr == NR21 ? 1 : addr == NR31 ? 2 : 3, now);
+        break;
+    case NR12:
+    case NR22:
+    case NR42:
+    {
+        size_t index = addr == NR12 ? 0 : addr == NR22 ? 1 : 3;
+        Channel& ch = channel(index);
+        ch.dac = value & 0xf8;
+        ch.enabled = ch.enabled && ch.dac;
+        update_level(index, now);
+        break;
+    }
+    case NR13:
+    case NR23:
+    {
+        SquareChannel& ch = addr == NR13 ? square1 : square2;
+        ch.frequency = (ch.frequency & 0x700) | value;
+        ch.period = square_period(ch.frequency);
+        break;
+    }
+    case NR14:
+    case NR24:
+    {
+        size_t index = addr == NR14 ? 0 : 1;
+        SquareChannel& ch = index == 0 ? square1 : square2;
+        ch.frequency = (ch.frequency & 0xff) | ((value & 7) << 8);
+        ch.period = square_period(ch.frequency);
+        write_control(ch, 64, value);
+        if (bit(value, 7))
+        {
+            trigger(index, now);
+        }
+        update_level(index, now);
+        break;
+    }
+    case NR30:
+        wave.dac = bit(value, 7);
+        wave.enabled = wave.enabled && wave.dac;
+        update_level(2, now);
+        break;
+    case NR32:
+        update_level(2, now);
+        break;
+    case NR33:
+        wave.frequency = (wave.frequency & 0x700) | value;
+        wave.period = wave_period(wave.frequency);
+        break;
+    case NR34:
+        wave.frequency = (wave.frequency & 0xff) | ((value & 7) << 8);
+        wave.period = wave_period(wave.frequency);
+        write_control(wave, 256, value);
+        if (bit(value, 7))
+        {
+            trigger(2, now);
+        }
+        update_level(2, now);
+        break;
+    case NR43:
+        noise.period = noise_period(value);
+        if (noise.period == 0)
+        {
+            noise.next = NEVER;
+        }
+        else if (noise.next == NEVER)
+        {
+            noise.next = now + noise.period;
+        }
+        break;
+    case NR44:
+        write_control(noise, 64, value);
+        if (bit(value, 7))
+        {
+            trigger(3, now);
+        }
+        update_level(3, now);
+        break;
+    case NR50:
+        update_mix(old, reg(NR51), now);
+        break;
+    case NR51:
+        update_mix(reg(NR50), old, now);
+        break;
+    default:
+        break;
+    }
+}
+
+void APU::catch_up(const Gameboy& gb)
+{
+    uint64_t now = gb.scheduler.now;
+    if (!audio)
+    {
+        last_time = now;
+        return;
+    }
+    while (last_time < now)
+    {
+        // Blocks end at frame sequencer steps and never outgrow the output buffer
+        uint64_t step = power ? next_frame_step(gb, last_time) : NEVER;
+        uint64_t until = std::min({now, step, last_time + buffer.max_block()});
+        buffer.make_room(until);
+        run(until);
+        last_time = until;
+        if (until == step)
+        {
+            step_frame_sequencer(until);
+        }
+    }
+}
+
+void APU::on_div_reset(Gameboy& gb)
+{
+    // Clearing the counter while bit 12 is set is a falling edge
+    catch_up(gb);
+    uint64_t now = gb.scheduler.now;
+    if (power && (gb.timer.counter(now) & (FRAME_SEQUENCER_DOTS / 2)))
+    {
+        step_frame_sequencer(now);
+    }
+    // Called before the counter is cleared, the next edge is a full period away
+    if (power && !audio)
+    {
+        gb.scheduler.schedule(Event::APU, now + FRAME_SEQUENCER_DOTS);
+    }
+}
+
+size_t APU::read_samples(const Gameboy& gb, int16_t* out, size_t frames)
+{
+    if (!audio)
+    {
+        return 0;
+    }
+    catch_up(gb);
+    return buffer.read(out, frames, gb.scheduler.now);
+}
+
+void APU::set_sample_rate(const Gameboy& gb, uint32_t rate)
+{
+    catch_up(gb);
+    buffer.set_rate(rate, gb.scheduler.now);
+}
+
+// `queued` frames are waiting in the audio device, which should hold about `target` of them
+void APU::sync_to_device(const Gameboy& gb, size_t queued, size_t target)
+{
+    catch_up(gb);
+    buffer.adjust_rate(queued, target, gb.scheduler.now);
+}
+
+void APU::set_audio(Gameboy& gb, bool enabled)
+{
+    if (enabled == audio)
+    {
+        return;
+    }
+    catch_up(gb);
+    audio = enabled;
+    restart_output(gb);
+}
+
+// The waveforms restart from the current time into an empty buffer, also used when a savestate is loaded
+void APU::restart_output(Gameboy& gb)
+{
+    uint64_t now = gb.scheduler.now;
+    last_time = now;
+    schedule_frame_step(gb);
+    if (!audio)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        Channel& ch = channel(i);
+        ch.level = 0;
+        ch.next = ch.period ? now + ch.period : NEVER;
+    }
+    buffer.clear(now);
+    for (size_t i = 0; i < 4; ++i)
+    {
+        update_level(i, now);
+    }
+}
+
+bool APU::start_capture(const Gameboy& gb, const char* path, AudioFormat format)
+{
+    FILE* file = nullptr;
+    if (!audio || fopen_s(&file, path, "wb") != 0)
+    {
+        return false;
+    }
+    stop_capture(gb);
+
+    // Starts at the current frame boundary, older samples are not recorded
+    catch_up(gb);
+    buffer.read(nullptr, SIZE_MAX, gb.scheduler.now);
+    capture = std::make_shared<AudioCapture>(file, format, buffer.rate);
+    return true;
+}
+
+void APU::stop_capture(const Gameboy& gb)
+{
+    if (capture)
+    {
+        capture_frame(gb);
+        capture = nullptr;
+    }
+}
+
+void APU::capture_frame(const Gameboy& gb)
+{
+    if (!capture)
+    {
+        return;
+    }
+    int16_t samples[1024 * 2];
+    while (size_t frames = read_samples(gb, samples, 1024))
+    {
+        capture->write(samples, frames);
+    }
+}
+
+void APU::on_event(Gameboy& gb, uint64_t when)
+{
+    step_frame_sequencer(when);
+    schedule_frame_step(gb);
+}
+
+uint8_t& APU::reg(uint16_t addr)
+{
+    return regs[addr - NR10];
+}
+
+uint64_t APU::next_frame_step(const Gameboy& gb, uint64_t after) const
+{
+    return after + FRAME_SEQUENCER_DOTS - (gb.timer.counter(after) & (FRAME_SEQUENCER_DOTS - 1));
+}
+
+void APU::schedule_frame_step(Gameboy& gb)
+{
+    if (power && !audio)
+    {
+        gb.scheduler.schedule(Event::APU, next_frame_step(gb, gb.scheduler.now));
+    }
+    else
+    {
+        gb.scheduler.cancel(Event::APU);
+    }
+}
+
+void APU::step_frame_sequencer(uint64_t time)
+{
+    if (!(frame_step & 1))
+    {
+        for (size_t i = 0; i < 4; ++i)
+        {
+            channel(i).clock_length();
+        }
+    }
+    if (frame_step == 2 || frame_step == 6)
+    {
+        step_sweep();
+    }
+    if (frame_step == 7)
+    {
+        square1.envelope.step(reg(NR12));
+        square2.envelope.step(reg(NR22));
+        noise.envelope.step(reg(NR42));
+    }
+    frame_step = (frame_step + 1) & 7;
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        update_level(i, time);
+    }
+}
+
+void APU::step_sweep()
+{
+    uint8_t period = (reg(NR10) >> 4) & 7;
+    if (square1.sweep_timer > 0 && --square1.sweep_timer > 0)
+    {
+        return;
+    }
+    square1.sweep_timer = period ? period : 8;
+    if (!square1.sweep_enabled || period == 0)
+    {
+        return;
+    }
+
+    uint16_t target = sweep_target();
+    if (target <= 2047 && (reg(NR10) & 7))
+    {
+        square1.frequency = target;
+        square1.shadow = target;
+        square1.period = square_period(target);
+        reg(NR13) = target & 0xff;
+        reg(NR14) = (reg(NR14) & 0xf8) | (target >> 8);
+        // The new frequency is checked again for an overflow
+        sweep_target();
+    }
+}
+
+uint16_t APU::sweep_target()
+{
+    uint16_t delta = square1.shadow >> (reg(NR10) & 7);
+    uint16_t target = bit(reg(NR10), 3) ? square1.shadow - delta : square1.shadow + delta;
+    if (target > 2047)
+    {
+        square1.enabled = false;
+    }
+    return target;
+}
+
+void APU::write_length(uint16_t addr, uint8_t value)
+{
+    switch (addr)
+    {
+    case NR11:
+        square1.length = 64 - (value & 0x3f);
+        break;
+    case NR21:
+        square2.length = 64 - (value & 0x3f);
+        break;
+    case NR31:
+        wave.length = 256 - value;
+        break;
+    default:
+        noise.length = 64 - (value & 0x3f);
+        break;
+    }
+}
+
+void APU::write_control(Channel& ch, uint16_t max_length, uint8_t value)
+{
+    // Lengths are clocked on even frame sequencer steps, enabling the counter before an odd step clocks it once more
+    bool was_enabled = ch.length_enabled;
+    bool extra_clock = frame_step & 1;
+    ch.length_enabled = bit(value, 6);
+    if (extra_clock && !was_enabled && ch.length_enabled && ch.length > 0)
+    {
+        ch.clock_length();
+    }
+    if (bit(value, 7) && ch.length == 0)
+    {
+        ch.length = max_length;
+        if (extra_clock && ch.length_enabled)
+        {
+            ch.length -= 1;
+        }
+    }
+}
+
+void APU::trigger(size_t index, uint64_t now)
+{
+    Channel& ch = channel(index);
+    ch.enabled = ch.dac;
+    switch (index)
+    {
+    case 0:
+    case 1:
+    {
+        SquareChannel& square = index == 0 ? square1 : square2;
+        square.next = now + square.period;
+        square.envelope.trigger(reg(index == 0 ? NR12 : NR22));
+        if (index == 0)
+        {
+            uint8_t period = (reg(NR10) >> 4) & 7;
+            uint8_t shift = reg(NR10) & 7;
+            square1.shadow = square1.frequency;
+            square1.sweep_timer = period ? period : 8;
+            square1.sweep_enabled = period || shift;
+            if (shift)
+            {
+                sweep_target();
+            }
+        }
+        break;
+    }
+    case 2:
+        wave.position = 0;
+        wave.next = now + wave.period;
+        break;
+    default:
+        noise.lfsr = 0x7fff;
+        noise.envelope.trigger(reg(NR42));
+        noise.next = noise.period ? now + noise.period : NEVER;
+        break;
+    }
+}
+
+void APU::power_off(uint64_t now)
+{
+    // Every register is cleared, the DMG length counters are kept
+    for (size_t i = 0; i < 4; ++i)
+    {
+        Channel& ch = channel(i);
+        ch.enabled = false;
+        ch.dac = false;
+        ch.length_enabled = false;
+        update_level(i, now);
+    }
+    memset(regs, 0, NR52 - NR10);
+    square1.frequency = 0;
+    square1.period = square_period(0);
+    square2.frequency = 0;
+    square2.period = square_period(0);
+    wave.frequency = 0;
+    wave.period = wave_period(0);
+    noise.period = 0;
+    noise.next = NEVER;
+    power = false;
+}
+
+void APU::run(uint64_t until)
+{
+    run_square(0, until);
+    run_square(1, until);
+    run_wave(until);
+    run_noise(until);
+}
+
+void APU::run_square(size_t index, uint64_t until)
+{
+    SquareChannel& ch = index == 0 ? square1 : square2;
+    if (ch.next > until)
+    {
+        return;
+    }
+    if (!ch.enabled || ch.envelope.volume == 0)
+    {
+        // Silent, only the duty position has to follow
+        uint64_t steps = (until - ch.next) / ch.period + 1;
+        ch.position = (ch.position + steps) & 7;
+        ch.next += steps * ch.period;
+        return;
+    }
+    while (ch.next <= until)
+    {
+        ch.position = (ch.position + 1) & 7;
+        update_level(index, ch.next);
+        ch.next += ch.period;
+    }
+}
+
+void APU::run_wave(uint64_t until)
+{
+    if (wave.next > until)
+    {
+        return;
+    }
+    if (!wave.enabled || (reg(NR32) & 0x60) == 0)
+    {
+        uint64_t steps = (until - wave.next) / wave.period + 1;
+        wave.position = (wave.position + steps) & 31;
+        wave.next += steps * wave.period;
+        return;
+    }
+    while (wave.next <= until)
+    {
+        wave.position = (wave.position + 1) & 31;
+        update_level(2, wave.next);
+        wave.next += wave.period;
+    }
+}
+
+void APU::run_noise(uint64_t until)
+{
+    if (noise.next > until)
+    {
+        return;
+    }
+    if (!noise.enabled)
+    {
+        // The LFSR is reset by the next trigger
+        noise.next += ((until - noise.next) / noise.period + 1) * noise.period;
+        return;
+    }
+    bool narrow = bit(reg(NR43), 3);
+    while (noise.next <= until)
+    {
+        uint16_t x = (noise.lfsr ^ (noise.lfsr >> 1)) & 1;
+        noise.lfsr = (noise.lfsr >> 1) | (x << 14);
+        if (narrow)
+        {
+            noise.lfsr = (noise.lfsr & ~0x40) | (x << 6);
+        }
+        update_level(3, noise.next);
+        noise.next += noise.period;
+    }
+}
+
+Channel& APU::channel(size_t index)
+{
+    switch (index)
+    {
+    case 0:
+        return square1;
+    case 1:
+        return square2;
+    case 2:
+        return wave;
+    default:
+        return noise;
+    }
+}
+
+// DAC output between -15 and 15, 0 when the DAC is off
+int32_t APU::channel_output(size_t index) const
+{
+    uint8_t digital = 0;
+    switch (index)
+    {
+    case 0:
+    case 1:
+    {
+        const SquareChannel& ch = index == 0 ? square1 : square2;
+        if (!ch.dac)
+        {
+            return 0;
+        }
+        uint8_t duty = regs[(index == 0 ? NR11 : NR21) - NR10] >> 6;
+        digital = ch.enabled && bit(duty_patterns[duty], ch.position) ? ch.envelope.volume : 0;
+        break;
+    }
+    case 2:
+    {
+        if (!wave.dac)
+        {
+            return 0;
+        }
+        uint8_t code = (regs[NR32 - NR10] >> 5) & 3;
+        uint8_t sample = (wave_ram[wave.position / 2] >> (wave.position & 1 ? 0 : 4)) & 0xf;
+        digital = wave.enabled && code ? sample >> (code - 1) : 0;
+        break;
+    }
+    default:
+        if (!noise.dac)
+        {
+            return 0;
+        }
+        digital = noise.enabled && !(noise.lfsr & 1) ? noise.envelope.volume : 0;
+        break;
+    }
+    return 2 * digital - 15;
+}
+
+void APU::update_level(size_t index, uint64_t time)
+{
+    if (!audio)
+    {
+        return;
+    }
+    Channel& ch = channel(index);
+    int32_t level = channel_output(index);
+    int32_t delta = level - ch.level;
+    if (delta == 0)
+    {
+        return;
+    }
+    ch.level = level;
+    uint8_t nr50 = reg(NR50);
+    uint8_t nr51 = reg(NR51);
+    buffer.add_delta(time, delta * mix_gain(nr50, nr51, index, 0), delta * mix_gain(nr50, nr51, index, 1));
+}
+
+void APU::update_mix(uint8_t old_nr50, uint8_t old_nr51, uint64_t time)
+{
+    if (!audio)
+    {
+        return;
+    }
+    int32_t deltas[2] = {};
+    for (size_t i = 0; i < 4; ++i)
+    {
+        for (size_t side = 0; side < 2; ++side)
+        {
+            int32_t gain = mix_gain(reg(NR50), reg(NR51), i, side);
+            deltas[side] += channel(i).level * (gain - mix_gain(old_nr50, old_nr51, i, side));
+        }
+    }
+    buffer.add_delta(time, deltas[0], deltas[1]);
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <memory>
+
+#include "common.h"
+#include "audio_buffer.h"
+#include "audio_capture.h"
+
+struct Gameboy;
+
+// Common channel state. The waveform advances every `period` dots, `next` is the time of the next step
+struct Channel
+{
+    bool enabled = false;
+    bool dac = false;
+    bool length_enabled = false;
+    uint16_t length = 0;
+    uint32_t period = 0;
+    uint64_t next = 0;
+    int32_t level = 0; // Last output sent to the mixer
+
+    void clock_length();
+};
+
+struct Envelope
+{
+    uint8_t volume = 0;
+    uint8_t timer = 0;
+
+    void trigger(uint8_t nrx2);
+    void step(uint8_t nrx2);
+};
+
+struct SquareChannel : Channel
+{
+    Envelope envelope;
+    uint16_t frequency = 0;
+    uint8_t position = 0;
+
+    // Channel 1 only
+    bool sweep_enabled = false;
+    uint16_t shadow = 0;
+    uint8_t sweep_timer = 0;
+};
+
+struct WaveChannel : Channel
+{
+    uint16_t frequency = 0;
+    uint8_t position = 0;
+};
+
+struct NoiseChannel : Channel
+{
+    Envelope envelope;
+    uint16_t lfsr = 0x7fff;
+};
+
+// The four DMG channels, mixed into a band-limited AudioBuffer. Nothing runs per dot: the channels are synthesized in blocks
+// between the last catch up and the current time, which happens when an APU register is accessed or samples are
+// pulled. The frame sequencer follows the falling edges of bit 12 of the timer counter, so its steps are computed
+// from the timer instead of being scheduled. With audio off nothing is synthesized or mixed and the frame sequencer
+// runs from scheduled events, so the registers, length counters and sweep behave the same
+struct APU
+{
+    static constexpr uint16_t NR10 = 0xff10;
+    static constexpr uint16_t NR11 = 0xff11;
+    static constexpr uint16_t NR12 = 0xff12;
+    static constexpr uint16_t NR13 = 0xff13;
+    static constexpr uint16_t NR14 = 0xff14;
+    static constexpr uint16_t NR21 = 0xff16;
+    static constexpr uint16_t NR22 = 0xff17;
+    static constexpr uint16_t NR23 = 0xff18;
+    static constexpr uint16_t NR24 = 0xff19;
+    static constexpr uint16_t NR30 = 0xff1a;
+    static constexpr uint16_t NR31 = 0xff1b;
+    static constexpr uint16_t NR32 = 0xff1c;
+    static constexpr uint16_t NR33 = 0xff1d;
+    static constexpr uint16_t NR34 = 0xff1e;
+    static constexpr uint16_t NR41 = 0xff20;
+    static constexpr uint16_t NR42 = 0xff21;
+    static constexpr uint16_t NR43 = 0xff22;
+    static constexpr uint16_t NR44 = 0xff23;
+    static constexpr uint16_t NR50 = 0xff24;
+    static constexpr uint16_t NR51 = 0xff25;
+    static constexpr uint16_t NR52 = 0xff26;
+    static constexpr uint16_t WAVE_BEGIN = 0xff30;
+    static constexpr uint16_t WAVE_END = 0xff3f;
+
+    static constexpr uint32_t FRAME_SEQUENCER_DOTS = 8192;
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    void reset(Gameboy& gb);
+    uint8_t read(Gameboy& gb, uint16_t addr);
+    void write(Gameboy& gb, uint16_t addr, uint8_t value);
+    void catch_up(const Gameboy& gb);
+    void on_div_reset(Gameboy& gb);
+    size_t read_samples(const Gameboy& gb, int16_t* out, size_t frames);
+    void set_sample_rate(const Gameboy& gb, uint32_t rate);
+    void sync_to_device(const Gameboy& gb, size_t queued, size_t target);
+    void set_audio(Gameboy& gb, bool enabled);
+    void restart_output(Gameboy& gb);
+    bool start_capture(const Gameboy& gb, const char* path, AudioFormat format);
+    void stop_capture(const Gameboy& gb);
+    void capture_frame(const Gameboy& gb);
+    void on_event(Gameboy& gb, uint64_t when);
+
+    SquareChannel square1;
+    SquareChannel square2;
+    WaveChannel wave;
+    NoiseChannel noise;
+
+    uint8_t regs[WAVE_BEGIN - NR10] = {};
+    uint8_t wave_ram[0x10] = {};
+    bool power = true;
+    bool audio = true;
+    uint8_t frame_step = 0;
+    uint64_t last_time = 0;
+
+    AudioBuffer buffer;
+    // Takes every sample produced while it is set, filled at the end of each frame by Gameboy::run_frame
+    std::shared_ptr<AudioCapture> capture;
+
+private:
+    uint8_t& reg(uint16_t addr);
+    uint64_t next_frame_step(const Gameboy& gb, uint64_t after) const;
+    void schedule_frame_step(Gameboy& gb);
+    void step_frame_sequencer(uint64_t time);
+    void step_sweep();
+    uint16_t sweep_target();
+    void write_length(uint16_t addr, uint8_t value);
+    void write_control(Channel& channel, uint16_t max_length, uint8_t value);
+    void trigger(size_t index, uint64_t now);
+    void power_off(uint64_t now);
+
+    void run(uint64_t until);
+    void run_square(size_t index, uint64_t until);
+    void run_wave(uint64_t until);
+    void run_noise(uint64_t until);
+
+    Channel& channel(size_t index);
+    int32_t channel_output(size_t index) const;
+    void update_level(size_t index, uint64_t time);
+    void update_mix(uint8_t nr50, uint8_t nr51, uint64_t time);
+};
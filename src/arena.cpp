@@ -0,0 +1,106 @@
+#include "arena.h"
+
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+struct FreeSlot
+{
+    void* p;
+    size_t size;
+};
+
+static std::mutex free_mutex;
+static std::vector<FreeSlot> free_slots;
+
+struct Block
+{
+    uint8_t* next = nullptr;
+    uint8_t* end = nullptr;
+};
+
+static thread_local Block current_block;
+
+static uint8_t* map_block()
+{
+#ifdef _WIN32
+    // Large pages need the lock pages privilege, they are committed up front
+    void* p = nullptr;
+    size_t large_page = GetLargePageMinimum();
+    if (large_page > 0 && Arena::BLOCK_SIZE % large_page == 0)
+    {
+        p = VirtualAlloc(nullptr, Arena::BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    }
+    if (p == nullptr)
+    {
+        p = VirtualAlloc(nullptr, Arena::BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    ASSERT_MSG(p != nullptr, "Could not allocate an arena block");
+    return (uint8_t*)p;
+#else
+    // Transparent huge pages need the block aligned on them, the mapping is trimmed to an aligned block
+    size_t size = Arena::BLOCK_SIZE + Arena::HUGE_PAGE_SIZE;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_MSG(p != MAP_FAILED, "Could not allocate an arena block");
+    uintptr_t begin = (uintptr_t)p;
+    uintptr_t aligned = (begin + Arena::HUGE_PAGE_SIZE - 1) & ~uintptr_t(Arena::HUGE_PAGE_SIZE - 1);
+    if (aligned > begin)
+    {
+        munmap(p, aligned - begin);
+    }
+    if (aligned + Arena::BLOCK_SIZE < begin + size)
+    {
+        munmap((void*)(aligned + Arena::BLOCK_SIZE), begin + size - aligned - Arena::BLOCK_SIZE);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise((void*)aligned, Arena::BLOCK_SIZE, MADV_HUGEPAGE);
+#endif
+    return (uint8_t*)aligned;
+#endif
+}
+
+void* Arena::allocate(size_t size)
+{
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    ASSERT_MSG(size <= BLOCK_SIZE, "Allocation larger than an arena block");
+
+    {
+        std::lock_guard lock(free_mutex);
+        for (size_t i = 0; i < free_slots.size(); ++i)
+        {
+            if (free_slots[i].size == size)
+            {
+                void* p = free_slots[i].p;
+                free_slots[i] = free_slots.back();
+                free_slots.pop_back();
+                return p;
+            }
+        }
+    }
+
+    Block& block = current_block;
+    if (block.next == nullptr || size_t(block.end - block.next) < size)
+    {
+        block.next = map_block();
+        block.end = block.next + BLOCK_SIZE;
+    }
+    void* p = block.next;
+    block.next += size;
+    return p;
+}
+
+void Arena::free(void* p, size_t size)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    std::lock_guard lock(free_mutex);
+    free_slots.push_back({p, size});
+}
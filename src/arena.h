@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+// Memory for emulator instances. Instances are carved next to each other from large blocks backed by huge pages when
+// the system provides them, so that thousands of instances only take a few TLB entries. Each thread carves from its own
+// block, an instance is first touched by the thread that creates it and lands on its NUMA node. Freed slots are reused
+// by the next allocation of the same size, the blocks are kept until the process exits
+struct Arena
+{
+    static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+    static constexpr size_t BLOCK_SIZE = 16 << 20;
+    static constexpr size_t ALIGNMENT = 64;
+
+    static void* allocate(size_t size);
+    static void free(void* p, size_t size);
+};
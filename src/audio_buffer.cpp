@@ -0,0 +1,160 @@
+#include "audio_buffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Band-limited impulses for each phase, duplicated for the left and right halves of a stereo frame. Every phase sums
+// to exactly 1 << KERNEL_SHIFT so that integrating the deltas gives back the levels without drift
+static const std::vector<int32_t> kernels = [] {
+    constexpr size_t taps = AudioBuffer::TAPS;
+    constexpr double pi = 3.14159265358979323846;
+    constexpr double cutoff = 0.45; // Relative to the output rate
+    std::vector<int32_t> res(AudioBuffer::PHASES * taps * 2);
+    for (size_t p = 0; p < AudioBuffer::PHASES; ++p)
+    {
+        double h[taps];
+        double sum = 0;
+        for (size_t k = 0; k < taps; ++k)
+        {
+            double x = double(k) - (taps / 2 - 1) - double(p) / AudioBuffer::PHASES;
+            double sinc = x == 0 ? 1 : std::sin(2 * pi * cutoff * x) / (2 * pi * cutoff * x);
+            double w = (x + taps / 2) / taps;
+            double window = 0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+            h[k] = sinc * std::max(window, 0.0);
+            sum += h[k];
+        }
+
+        int32_t total = 0;
+        int32_t* kernel = res.data() + p * taps * 2;
+        for (size_t k = 0; k < taps; ++k)
+        {
+            int32_t value = int32_t(std::lround(h[k] / sum * (1 << AudioBuffer::KERNEL_SHIFT)));
+            kernel[k * 2] = value;
+            kernel[k * 2 + 1] = value;
+            total += value;
+        }
+        kernel[(taps / 2 - 1) * 2] += (1 << AudioBuffer::KERNEL_SHIFT) - total;
+        kernel[(taps / 2 - 1) * 2 + 1] += (1 << AudioBuffer::KERNEL_SHIFT) - total;
+    }
+    return res;
+}();
+
+void AudioBuffer::reset(uint32_t _rate, uint64_t time)
+{
+    deltas.assign((CAPACITY + TAPS) * 2, 0);
+    used = 0;
+    levels[0] = levels[1] = 0;
+    capacitors[0] = capacitors[1] = 0;
+    base_time = time;
+    base_position = 0;
+    set_rate(_rate, time);
+}
+
+// Empties the buffer without reallocating it, only the written part needs clearing
+void AudioBuffer::clear(uint64_t time)
+{
+    memset(deltas.data(), 0, used * 2 * sizeof(int32_t));
+    used = 0;
+    levels[0] = levels[1] = 0;
+    capacitors[0] = capacitors[1] = 0;
+    base_time = time;
+    base_position = 0;
+}
+
+void AudioBuffer::set_rate(uint32_t _rate, uint64_t time)
+{
+    rate = _rate;
+    // High-pass filter of the output capacitor
+    charge_factor = std::pow(0.999958f, float(CLOCK_RATE) / rate);
+    set_step((uint64_t(rate) << 32) / CLOCK_RATE, time);
+}
+
+// Dynamic rate control: produces slightly more samples when the device queue runs low and fewer when it fills up
+void AudioBuffer::adjust_rate(size_t queued, size_t target, uint64_t time)
+{
+    double error = std::clamp((double(target) - double(queued)) / std::max<size_t>(target, 1), -1.0, 1.0);
+    double nominal = double(uint64_t(rate) << 32) / CLOCK_RATE;
+    set_step(uint64_t(nominal * (1 + MAX_RATE_ADJUST * error)), time);
+}
+
+void AudioBuffer::add_delta(uint64_t time, int32_t left, int32_t right)
+{
+    int64_t pos = position(time);
+    size_t index = size_t(pos >> 32);
+    size_t phase = size_t(pos >> (32 - PHASE_BITS)) & (PHASES - 1);
+    ASSERT(pos >= 0 && index < CAPACITY);
+
+    const int32_t* kernel = kernels.data() + phase * TAPS * 2;
+    int32_t* out = deltas.data() + index * 2;
+    used = std::max(used, index + TAPS);
+    int32_t frame[TAPS * 2];
+    for (size_t i = 0; i < TAPS * 2; i += 2)
+    {
+        frame[i] = left;
+        frame[i + 1] = right;
+    }
+    // Contiguous and branch free, compiles to a few vector multiply-adds
+    for (size_t i = 0; i < TAPS * 2; ++i)
+    {
+        out[i] += frame[i] * kernel[i];
+    }
+}
+
+void AudioBuffer::make_room(uint64_t time)
+{
+    // Samples nobody pulled are dropped, the levels still have to follow their deltas
+    size_t end = available(time) + TAPS;
+    if (end >= CAPACITY)
+    {
+        integrate(nullptr, end - CAPACITY + 1);
+    }
+}
+
+size_t AudioBuffer::read(int16_t* out, size_t frames, uint64_t time)
+{
+    frames = std::min(frames, available(time));
+    integrate(out, frames);
+    return frames;
+}
+
+void AudioBuffer::set_step(uint64_t new_step, uint64_t time)
+{
+    // Anchors the positions at `time` so that earlier deltas stay in place
+    base_position = position(time);
+    base_time = time;
+    step = new_step;
+}
+
+void AudioBuffer::integrate(int16_t* out, size_t frames)
+{
+    for (size_t i = 0; i < frames; ++i)
+    {
+        for (size_t side = 0; side < 2; ++side)
+        {
+            // The filter also runs over dropped samples so that readers see the same output
+            levels[side] += deltas[i * 2 + side];
+            float in = float(levels[side]) * (float(OUTPUT_SCALE) / (1 << KERNEL_SHIFT));
+            float sample = in - capacitors[side];
+            capacitors[side] = in - sample * charge_factor;
+            if (out != nullptr)
+            {
+                out[i * 2 + side] = int16_t(std::clamp(sample, -32768.0f, 32767.0f));
+            }
+        }
+    }
+
+    // The kernel tails and the unread samples move to the front
+    if (used > frames)
+    {
+        memmove(deltas.data(), deltas.data() + frames * 2, (used - frames) * 2 * sizeof(int32_t));
+        memset(deltas.data() + (used - frames) * 2, 0, frames * 2 * sizeof(int32_t));
+        used -= frames;
+    }
+    else
+    {
+        memset(deltas.data(), 0, used * 2 * sizeof(int32_t));
+        used = 0;
+    }
+    base_position -= int64_t(frames) << 32;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+
+#include "common.h"
+
+// Stereo band-limited synthesis at the output rate. The APU only adds a delta when the mixed level changes, each delta
+// is spread over TAPS samples with the phase of a windowed sinc kernel matching its position between two output
+// samples, which resamples the 4 MHz steps without aliasing. Samples are integrated and high-pass filtered when read.
+// Positions are 32.32 fixed point samples from the start of the buffer, the step per dot can be nudged to follow the
+// consumption of the audio device
+struct AudioBuffer
+{
+    static constexpr uint32_t CLOCK_RATE = 1 << 22; // Dots per second
+    static constexpr uint32_t DEFAULT_RATE = 48000;
+    static constexpr size_t CAPACITY = 1 << 14;
+    static constexpr size_t TAPS = 16;
+    static constexpr size_t PHASE_BITS = 6;
+    static constexpr size_t PHASES = 1 << PHASE_BITS;
+    static constexpr int32_t KERNEL_SHIFT = 15;
+    static constexpr int32_t OUTPUT_SCALE = 64;
+    static constexpr double MAX_RATE_ADJUST = 0.005;
+
+    void reset(uint32_t rate = DEFAULT_RATE, uint64_t time = 0);
+    void clear(uint64_t time);
+    void set_rate(uint32_t rate, uint64_t time);
+    void adjust_rate(size_t queued, size_t target, uint64_t time);
+    void add_delta(uint64_t time, int32_t left, int32_t right);
+    void make_room(uint64_t time);
+    size_t read(int16_t* out, size_t frames, uint64_t time);
+
+    inline int64_t position(uint64_t time) const
+    {
+        return base_position + int64_t(time - base_time) * int64_t(step);
+    }
+
+    // Samples before the one containing `time` receive no more deltas
+    inline size_t available(uint64_t time) const
+    {
+        int64_t pos = position(time);
+        return pos > 0 ? size_t(pos >> 32) : 0;
+    }
+
+    // Longest span of time whose deltas fit in the buffer
+    inline uint64_t max_block() const
+    {
+        return (uint64_t(CAPACITY / 2) << 32) / step;
+    }
+
+    uint32_t rate = DEFAULT_RATE;
+    uint64_t step = 0;
+    uint64_t base_time = 0;
+    int64_t base_position = 0;
+
+    // Interleaved left and right deltas, TAPS samples past the capacity leave room for the kernel tails
+    std::vector<int32_t> deltas;
+    size_t used = 0;
+    int32_t levels[2] = {};
+    float capacitors[2] = {};
+    float charge_factor = 0;
+
+private:
+    void set_step(uint64_t new_step, uint64_t time);
+    void integrate(int16_t* out, size_t frames);
+};
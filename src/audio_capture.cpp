@@ -0,0 +1,117 @@
+#include "audio_capture.h"
+
+#include <algorithm>
+#include <cstring>
+
+AudioCapture::AudioCapture(FILE* _file, AudioFormat _format, uint32_t _rate)
+    : format(_format), rate(_rate), file(_file), chunks(CHUNK_COUNT)
+{
+    for (Chunk& chunk : chunks)
+    {
+        free_chunks.push(&chunk);
+    }
+    free_chunks.pop(&current, 1);
+    if (format == AudioFormat::WAV)
+    {
+        // The sizes are patched when the capture stops
+        write_header(0);
+    }
+    thread = std::thread(&AudioCapture::run, this);
+}
+
+AudioCapture::~AudioCapture()
+{
+    flush();
+    quit.store(true, std::memory_order_release);
+    wake_writer();
+    thread.join();
+
+    if (format == AudioFormat::WAV)
+    {
+        fseek(file, 0, SEEK_SET);
+        write_header(uint32_t(std::min<uint64_t>(data_size, UINT32_MAX - 36)));
+    }
+    fclose(file);
+}
+
+void AudioCapture::write(const int16_t* samples, size_t frames)
+{
+    while (frames > 0)
+    {
+        if (current == nullptr && free_chunks.pop(&current, 1) == 0)
+        {
+            dropped += frames;
+            return;
+        }
+        size_t n = std::min(frames, CHUNK_FRAMES - current->frames);
+        memcpy(current->samples + current->frames * 2, samples, n * 2 * sizeof(int16_t));
+        current->frames += n;
+        samples += n * 2;
+        frames -= n;
+        if (current->frames == CHUNK_FRAMES)
+        {
+            flush();
+        }
+    }
+}
+
+// Hands the partially filled chunk to the writer
+void AudioCapture::flush()
+{
+    if (current == nullptr || current->frames == 0)
+    {
+        return;
+    }
+    full.push(current);
+    current = nullptr;
+    wake_writer();
+}
+
+void AudioCapture::run()
+{
+    while (true)
+    {
+        uint32_t seen = sequence.load(std::memory_order_acquire);
+        Chunk* chunk = nullptr;
+        while (full.pop(&chunk, 1) == 1)
+        {
+            fwrite(chunk->samples, sizeof(int16_t) * 2, chunk->frames, file);
+            data_size += chunk->frames * sizeof(int16_t) * 2;
+            chunk->frames = 0;
+            free_chunks.push(chunk);
+        }
+        if (quit.load(std::memory_order_acquire) && full.size() == 0)
+        {
+            break;
+        }
+        sequence.wait(seen, std::memory_order_acquire);
+    }
+    fflush(file);
+}
+
+void AudioCapture::write_header(uint32_t size)
+{
+    auto u32 = [](uint8_t* out, uint32_t value) { memcpy(out, &value, 4); };
+    auto u16 = [](uint8_t* out, uint16_t value) { memcpy(out, &value, 2); };
+
+    uint8_t header[44] = {};
+    memcpy(header, "RIFF", 4);
+    u32(header + 4, 36 + size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    u32(header + 16, 16);
+    u16(header + 20, 1); // PCM
+    u16(header + 22, 2);
+    u32(header + 24, rate);
+    u32(header + 28, rate * 4);
+    u16(header + 32, 4);
+    u16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    u32(header + 40, size);
+    fwrite(header, 1, sizeof(header), file);
+}
+
+void AudioCapture::wake_writer()
+{
+    sequence.fetch_add(1, std::memory_order_release);
+    sequence.notify_one();
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "ring_buffer.h"
+
+enum class AudioFormat
+{
+    WAV,
+    RAW, // Interleaved 16 bits stereo, little endian
+    Count
+};
+
+// Records the output of one instance to a file. Samples are copied into fixed size chunks, full chunks go to a writer
+// thread through a lock-free queue and come back through another one, so disk I/O never blocks emulation. When the
+// writer falls behind and no chunk is free the samples are dropped and counted
+struct AudioCapture
+{
+    static constexpr size_t CHUNK_FRAMES = 4096;
+    static constexpr size_t CHUNK_COUNT = 64;
+
+    struct Chunk
+    {
+        int16_t samples[CHUNK_FRAMES * 2];
+        size_t frames = 0;
+    };
+
+    AudioCapture(FILE* file, AudioFormat format, uint32_t rate);
+    ~AudioCapture();
+
+    AudioCapture(const AudioCapture&) = delete;
+    AudioCapture& operator=(const AudioCapture&) = delete;
+
+    void write(const int16_t* samples, size_t frames);
+    void flush();
+
+    AudioFormat format;
+    uint32_t rate;
+    uint64_t dropped = 0;
+
+private:
+    void run();
+    void write_header(uint32_t data_size);
+    void wake_writer();
+
+    FILE* file = nullptr;
+    std::vector<Chunk> chunks;
+    Chunk* current = nullptr;
+
+    RingBuffer<Chunk*, CHUNK_COUNT> full;
+    RingBuffer<Chunk*, CHUNK_COUNT> free_chunks;
+    std::atomic<uint32_t> sequence = 0;
+    std::atomic<bool> quit = false;
+
+    // Writer thread
+    uint64_t data_size = 0;
+    std::thread thread;
+};
@@ -0,0 +1,224 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "gameboy.h"
+
+using Clock = std::chrono::steady_clock;
+
+static void pin_to_core(std::thread& thread, size_t core)
+{
+#ifdef _WIN32
+    SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (core % 64));
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % CPU_SETSIZE, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    (void)thread;
+    (void)core;
+#endif
+}
+
+void BatchReport::print(FILE* file) const
+{
+    fprintf(file, "%" PRIu64 " frames in %.3f s, %.0f fps, %" PRIu64 " steals\n", frames, seconds, fps(), steals);
+    for (size_t i = 0; i < utilization.size(); ++i)
+    {
+        fprintf(file, "worker %2zu: %5.1f%% busy, %" PRIu64 " frames\n", i, utilization[i] * 100, worker_frames[i]);
+    }
+}
+
+BatchRunner::BatchRunner(size_t count, bool pin)
+{
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    count = count == 0 ? cores : count;
+    for (size_t i = 0; i < count; ++i)
+    {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        workers[i]->thread = std::thread(&BatchRunner::run_worker, this, i);
+        if (pin)
+        {
+            pin_to_core(workers[i]->thread, i % cores);
+        }
+    }
+}
+
+BatchRunner::~BatchRunner()
+{
+    quit.store(true, std::memory_order_release);
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+    for (auto& worker : workers)
+    {
+        worker->thread.join();
+    }
+}
+
+size_t BatchRunner::add(std::function<void(Gameboy&)> setup)
+{
+    setups.push_back(std::move(setup));
+    return setups.size() - 1;
+}
+
+BatchReport BatchRunner::run(uint64_t frames, uint32_t _quantum)
+{
+    instances.resize(setups.size());
+    remaining.assign(instances.size(), frames);
+    frames_per_run = frames;
+    quantum = std::max(_quantum, 1u);
+    instances_done.store(0, std::memory_order_relaxed);
+    workers_done.store(0, std::memory_order_relaxed);
+
+    auto begin = Clock::now();
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+    size_t done = workers_done.load(std::memory_order_acquire);
+    while (done != workers.size())
+    {
+        workers_done.wait(done, std::memory_order_acquire);
+        done = workers_done.load(std::memory_order_acquire);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    BatchReport report;
+    report.seconds = seconds;
+    for (auto& worker : workers)
+    {
+        report.frames += worker->frames;
+        report.steals += worker->steals;
+        report.utilization.push_back(seconds > 0 ? worker->busy_ns * 1e-9 / seconds : 0);
+        report.worker_frames.push_back(worker->frames);
+    }
+    return report;
+}
+
+Gameboy& BatchRunner::instance(size_t i)
+{
+    ASSERT_MSG(instances[i] != nullptr, "Instances are created by the first run");
+    return *instances[i];
+}
+
+size_t BatchRunner::size() const
+{
+    return setups.size();
+}
+
+void BatchRunner::run_worker(size_t index)
+{
+    uint32_t seen = 0;
+    while (true)
+    {
+        generation.wait(seen, std::memory_order_acquire);
+        seen = generation.load(std::memory_order_acquire);
+        if (quit.load(std::memory_order_acquire))
+        {
+            return;
+        }
+        work(index);
+        workers_done.fetch_add(1, std::memory_order_release);
+        workers_done.notify_all();
+    }
+}
+
+void BatchRunner::work(size_t index)
+{
+    Worker& worker = *workers[index];
+    worker.busy_ns = 0;
+    worker.frames = 0;
+    worker.steals = 0;
+
+    // New instances are created here so that their memory is first touched by their home worker
+    for (size_t i = index; i < instances.size(); i += workers.size())
+    {
+        if (instances[i] == nullptr)
+        {
+            instances[i] = std::make_unique<Gameboy>();
+            setups[i](*instances[i]);
+        }
+        if (remaining[i] == 0)
+        {
+            instances_done.fetch_add(1, std::memory_order_release);
+            continue;
+        }
+        push(index, uint32_t(i));
+    }
+
+    uint32_t i = 0;
+    while (instances_done.load(std::memory_order_acquire) < instances.size())
+    {
+        if (!pop(index, i))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        auto begin = Clock::now();
+        Gameboy& gb = *instances[i];
+        uint64_t n = std::min<uint64_t>(quantum, remaining[i]);
+        for (uint64_t frame = 0; frame < n; ++frame)
+        {
+            gb.run_frame();
+        }
+        remaining[i] -= n;
+        worker.frames += n;
+        worker.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+
+        if (remaining[i] == 0)
+        {
+            instances_done.fetch_add(1, std::memory_order_release);
+        }
+        else
+        {
+            push(i % workers.size(), i);
+        }
+    }
+}
+
+// The owner takes from the front of its queue, thieves from the back of the others
+bool BatchRunner::pop(size_t index, uint32_t& instance)
+{
+    {
+        Worker& worker = *workers[index];
+        std::lock_guard lock(worker.mutex);
+        if (!worker.queue.empty())
+        {
+            instance = worker.queue.front();
+            worker.queue.pop_front();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < workers.size(); ++k)
+    {
+        Worker& victim = *workers[(index + k) % workers.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.queue.empty())
+        {
+            instance = victim.queue.back();
+            victim.queue.pop_back();
+            workers[index]->steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void BatchRunner::push(size_t index, uint32_t instance)
+{
+    Worker& worker = *workers[index];
+    std::lock_guard lock(worker.mutex);
+    worker.queue.push_back(instance);
+}
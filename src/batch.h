@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+struct Gameboy;
+
+struct BatchReport
+{
+    double seconds = 0;
+    uint64_t frames = 0;
+    uint64_t steals = 0;
+    // Fraction of the run each worker spent running frames
+    std::vector<double> utilization;
+    std::vector<uint64_t> worker_frames;
+
+    double fps() const
+    {
+        return seconds > 0 ? frames / seconds : 0;
+    }
+
+    void print(FILE* file) const;
+};
+
+// Runs many independent instances on a pool of worker threads pinned to cores. Each instance has a home worker which
+// creates it, so that its memory is first touched and allocated on that worker's NUMA node, and which it goes back to
+// after every quantum. Idle workers steal quanta from the other queues. An instance is only ever run by one worker at
+// a time and always for the same number of frames, the results do not depend on the number of workers
+struct BatchRunner
+{
+    // 0 workers uses every hardware thread
+    explicit BatchRunner(size_t workers = 0, bool pin = true);
+    ~BatchRunner();
+
+    BatchRunner(const BatchRunner&) = delete;
+    BatchRunner& operator=(const BatchRunner&) = delete;
+
+    // `setup` loads the ROM and configures the instance, it runs on the home worker at the start of the next run
+    size_t add(std::function<void(Gameboy&)> setup);
+    // Runs every instance for `frames` frames, `quantum` frames at a time
+    BatchReport run(uint64_t frames, uint32_t quantum = 1);
+
+    Gameboy& instance(size_t i);
+    size_t size() const;
+
+private:
+    struct alignas(64) Worker
+    {
+        std::mutex mutex;
+        std::deque<uint32_t> queue;
+        std::thread thread;
+        // Owned by the worker during a run
+        uint64_t busy_ns = 0;
+        uint64_t frames = 0;
+        uint64_t steals = 0;
+    };
+
+    void work(size_t index);
+    void run_worker(size_t index);
+    bool pop(size_t index, uint32_t& instance);
+    void push(size_t index, uint32_t instance);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<Gameboy>> instances;
+    std::vector<std::function<void(Gameboy&)>> setups;
+    std::vector<uint64_t> remaining;
+
+    uint64_t frames_per_run = 0;
+    uint32_t quantum = 1;
+    std::atomic<size_t> instances_done = 0;
+    std::atomic<uint32_t> generation = 0;
+    std::atomic<size_t> workers_done = 0;
+    std::atomic<bool> quit = false;
+};
@@ -0,0 +1,50 @@
+#include "color.h"
+
+#include <algorithm>
+#include <vector>
+
+static uint32_t convert(uint16_t color, ColorCorrection correction)
+{
+    uint32_t r = color & 0x1f;
+    uint32_t g = (color >> 5) & 0x1f;
+    uint32_t b = (color >> 10) & 0x1f;
+
+    switch (correction)
+    {
+    case ColorCorrection::CGB_LCD:
+    {
+        // Approximates the colour mixing and the darker output of the CGB screen
+        uint32_t cr = std::min(960u, r * 26 + g * 4 + b * 2) >> 2;
+        uint32_t cg = std::min(960u, g * 24 + b * 8) >> 2;
+        uint32_t cb = std::min(960u, r * 6 + g * 4 + b * 22) >> 2;
+        r = cr;
+        g = cg;
+        b = cb;
+        break;
+    }
+    default:
+        r = (r << 3) | (r >> 2);
+        g = (g << 3) | (g >> 2);
+        b = (b << 3) | (b >> 2);
+        break;
+    }
+
+    return 0xff000000 | (b << 16) | (g << 8) | r;
+}
+
+static const std::vector<uint32_t> tables = [] {
+    std::vector<uint32_t> res(static_cast<size_t>(ColorCorrection::Count) * 0x8000);
+    for (size_t c = 0; c < static_cast<size_t>(ColorCorrection::Count); ++c)
+    {
+        for (size_t i = 0; i < 0x8000; ++i)
+        {
+            res[c * 0x8000 + i] = convert(i, static_cast<ColorCorrection>(c));
+        }
+    }
+    return res;
+}();
+
+const uint32_t* rgb555_table(ColorCorrection correction)
+{
+    return tables.data() + static_cast<size_t>(correction) * 0x8000;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+#include "enum_array.h"
+
+enum class ColorCorrection
+{
+    NONE,
+    CGB_LCD,
+    Count
+};
+
+static constexpr EnumArray<ColorCorrection, const char*> color_correction_str = {"NONE", "CGB_LCD"};
+
+// 32768 entries RGB555 to RGBA tables, one per correction curve, built once at startup
+const uint32_t* rgb555_table(ColorCorrection correction);
+
+inline uint8_t luminance(uint32_t rgba)
+{
+    uint32_t r = rgba & 0xff;
+    uint32_t g = (rgba >> 8) & 0xff;
+    uint32_t b = (rgba >> 16) & 0xff;
+    return (r * 77 + g * 150 + b * 29) >> 8;
+}
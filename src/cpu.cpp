@@ -22,7 +22,7 @@ void CPU::reset(const CartInfo& cart_info)
     sp = 0xfffe;
     pc = 0x0100;
     ime = 0;
-    enable_interrupts = false;
+    ei_delay = 0;
 }
 
 uint16_t CPU::read_reg(Reg reg) const
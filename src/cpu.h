@@ -25,7 +25,8 @@ struct CPU
 
     bool halted = false;
     bool stopped = false;
-    bool enable_interrupts = false;
+    // EI sets IME after the instruction that follows it
+    uint8_t ei_delay = 0;
 
     void reset(const CartInfo& cart_info);
     uint16_t read_reg(Reg reg) const;
@@ -2,36 +2,24 @@
 
 #include "gameboy.h"
 
-void DMA::start(uint8_t byte)
+void DMA::reset()
 {
-    start_byte = byte;
-    current_byte = 0;
-    delay = 2;
+    source_page = 0;
     active = false;
 }
 
-void DMA::tick(uint64_t cycles, Gameboy& gb)
+void DMA::start(Gameboy& gb, uint8_t page)
 {
-    if (!active)
-    {
-        return;
-    }
-
-    for (size_t i = 0; i < cycles; ++i)
-    {
-        if (delay > 0)
-        {
-            --delay;
-            continue;
-        }
-
-        uint8_t data = gb.memory.read(start_byte * 0x100 + current_byte);
-        gb.memory.write(0xfe00 + current_byte, data);
+    // Pages above the WRAM mirror read the WRAM
+    source_page = page >= 0xe0 ? page - 0x20 : page;
+    active = true;
+    gb.memory.set_bus_blocked(true);
+    gb.scheduler.schedule(Event::OAM_DMA, gb.scheduler.now + STARTUP_DOTS + TRANSFER_DOTS);
+}
 
-        if (current_byte == 0xa0)
-        {
-            active = false;
-            return;
-        }
-    }
+void DMA::on_event(Gameboy& gb)
+{
+    active = false;
+    gb.memory.set_bus_blocked(false);
+    gb.ppu.write_block(gb, Memory::OAM_BEGIN, gb.memory.mapped_pages[source_page], LENGTH);
 }
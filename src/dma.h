@@ -4,13 +4,19 @@
 
 struct Gameboy;
 
+// OAM DMA. The 160 bytes are copied at once at the end of the transfer window, during which the CPU only reaches the
+// IO registers and HRAM
 struct DMA
 {
-    void start(uint8_t byte);
-    void tick(uint64_t cycles, Gameboy& gb);
+    static constexpr uint16_t DMA_REG = 0xff46;
+    static constexpr uint16_t LENGTH = 0xa0;
+    static constexpr uint32_t STARTUP_DOTS = 4;
+    static constexpr uint32_t TRANSFER_DOTS = LENGTH * 4;
 
-    uint8_t start_byte = 0;
-    uint8_t current_byte = 0;
-    uint8_t delay = 0;
+    void reset();
+    void start(Gameboy& gb, uint8_t page);
+    void on_event(Gameboy& gb);
+
+    uint8_t source_page = 0;
     bool active = false;
 };
@@ -0,0 +1,232 @@
+#include "frame_output.h"
+
+#include <array>
+#include <cstring>
+
+#include "color.h"
+#include "renderer.h"
+
+// Byte i of spread_bits[b] is bit i of b
+static constexpr auto spread_bits = [] {
+    std::array<uint64_t, 256> table = {};
+    for (size_t i = 0; i < 256; ++i)
+    {
+        for (size_t b = 0; b < 8; ++b)
+        {
+            table[i] |= static_cast<uint64_t>((i >> b) & 1) << (b * 8);
+        }
+    }
+    return table;
+}();
+
+static void expand_indices(const Bitplane* planes, size_t n_planes, uint8_t* indices)
+{
+    for (size_t i = 0; i < FrameOutput::SCREEN_WIDTH / 8; ++i)
+    {
+        uint64_t v = 0;
+        for (size_t p = 0; p < n_planes; ++p)
+        {
+            uint8_t bits = planes[p].words[i / 8] >> ((i % 8) * 8);
+            v |= spread_bits[bits] << p;
+        }
+        memcpy(indices + i * 8, &v, 8);
+    }
+}
+
+// Packs 8 shades stored in bytes into 16 bits
+static uint16_t pack_shades(uint64_t v)
+{
+    v = (v | (v >> 6)) & 0x000f000f000f000full;
+    v = (v | (v >> 12)) & 0x000000ff000000ffull;
+    return static_cast<uint16_t>(v | (v >> 24));
+}
+
+bool FrameOutput::configure(PixelFormat _format, uint32_t _downsample, uint32_t _crop_x, uint32_t _crop_y,
+                            uint32_t crop_width, uint32_t crop_height)
+{
+    if ((_downsample != 1 && _downsample != 2 && _downsample != 4) || _crop_x + crop_width > SCREEN_WIDTH
+        || _crop_y + crop_height > SCREEN_HEIGHT || crop_width < _downsample || crop_height < _downsample)
+    {
+        return false;
+    }
+
+    format = _format;
+    downsample = _downsample;
+    crop_x = _crop_x;
+    crop_y = _crop_y;
+    width = crop_width / downsample;
+    height = crop_height / downsample;
+
+    switch (format)
+    {
+    case PixelFormat::RGBA:
+        stride = width * 4;
+        break;
+    case PixelFormat::PACKED:
+        stride = (width + 3) / 4;
+        break;
+    default:
+        stride = width;
+        break;
+    }
+
+    clear();
+    return true;
+}
+
+void FrameOutput::clear()
+{
+    Bitplane blank[PLANES];
+    memset(row_sums, 0, sizeof(row_sums));
+    row_changed = false;
+    for (uint32_t y = 0; y < height * downsample; ++y)
+    {
+        write_line(crop_y + y, blank, true);
+    }
+}
+
+void FrameOutput::set_color(size_t index, uint32_t rgba)
+{
+    colors[index] = rgba;
+    grays[index] = luminance(rgba);
+    shades[index] = (255 - grays[index] + 42) / 85;
+}
+
+void FrameOutput::write_line(uint8_t ly, const Bitplane* planes, bool changed)
+{
+    // Unchanged lines are already in the buffer, unless they are part of a downsampled row that changed
+    if (ly < crop_y || ly >= crop_y + height * downsample || (downsample == 1 && !changed))
+    {
+        return;
+    }
+
+    alignas(8) uint8_t indices[SCREEN_WIDTH];
+    expand_indices(planes, color ? PLANES : 2, indices);
+
+    // RGBA keeps colour indices, the other formats work on shades or grey levels
+    uint8_t* levels = indices + crop_x;
+    uint32_t n_pixels = width * downsample;
+    if (format == PixelFormat::GRAY && !color)
+    {
+        uint32_t x = 0;
+        for (; x + 8 <= n_pixels; x += 8)
+        {
+            uint64_t v;
+            memcpy(&v, levels + x, 8);
+            v = 0xffffffffffffffffull - v * 0x55;
+            memcpy(levels + x, &v, 8);
+        }
+        for (; x < n_pixels; ++x)
+        {
+            levels[x] = 255 - levels[x] * 0x55;
+        }
+    }
+    else if (format != PixelFormat::RGBA && color)
+    {
+        const uint8_t* table = format == PixelFormat::GRAY ? grays : shades;
+        for (uint32_t x = 0; x < n_pixels; ++x)
+        {
+            levels[x] = table[levels[x]];
+        }
+    }
+
+    uint32_t y = ly - crop_y;
+    uint8_t* out = data + (y / downsample) * stride;
+
+    if (downsample == 1)
+    {
+        write_row(levels, out);
+        return;
+    }
+
+    // Box filter, colours are averaged per channel
+    for (uint32_t x = 0; x < width; ++x)
+    {
+        for (uint32_t i = 0; i < downsample; ++i)
+        {
+            uint8_t level = levels[x * downsample + i];
+            if (format == PixelFormat::RGBA)
+            {
+                uint32_t c = colors[level];
+                row_sums[0][x] += c & 0xff;
+                row_sums[1][x] += (c >> 8) & 0xff;
+                row_sums[2][x] += (c >> 16) & 0xff;
+            }
+            else
+            {
+                row_sums[0][x] += level;
+            }
+        }
+    }
+
+    row_changed |= changed;
+    if (y % downsample != downsample - 1)
+    {
+        return;
+    }
+    if (row_changed)
+    {
+        uint32_t n = downsample * downsample;
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            if (format == PixelFormat::RGBA)
+            {
+                uint32_t c = 0xff000000;
+                for (uint32_t channel = 0; channel < 3; ++channel)
+                {
+                    c |= ((row_sums[channel][x] + n / 2) / n) << (channel * 8);
+                }
+                memcpy(out + x * 4, &c, 4);
+            }
+            else
+            {
+                levels[x] = (row_sums[0][x] + n / 2) / n;
+            }
+        }
+        if (format != PixelFormat::RGBA)
+        {
+            write_row(levels, out);
+        }
+    }
+    row_changed = false;
+    memset(row_sums, 0, sizeof(row_sums));
+}
+
+void FrameOutput::write_row(const uint8_t* levels, uint8_t* out) const
+{
+    switch (format)
+    {
+    case PixelFormat::RGBA:
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            memcpy(out + x * 4, &colors[levels[x]], 4);
+        }
+        break;
+    case PixelFormat::SHADE:
+    case PixelFormat::GRAY:
+        memcpy(out, levels, width);
+        break;
+    case PixelFormat::PACKED:
+    {
+        uint32_t x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            uint64_t v;
+            memcpy(&v, levels + x, 8);
+            uint16_t packed = pack_shades(v);
+            memcpy(out + x / 4, &packed, 2);
+        }
+        if (x < width)
+        {
+            uint64_t v = 0;
+            memcpy(&v, levels + x, width - x);
+            uint16_t packed = pack_shades(v);
+            memcpy(out + x / 4, &packed, (width - x + 3) / 4);
+        }
+        break;
+    }
+    default:
+        ASSERT_MSG(false, "Unknown pixel format");
+        break;
+    }
+}
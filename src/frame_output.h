@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+#include "enum_array.h"
+
+struct Bitplane;
+
+enum class PixelFormat
+{
+    RGBA,
+    SHADE,
+    GRAY,
+    PACKED,
+    Count
+};
+
+static constexpr EnumArray<PixelFormat, const char*> pixel_format_str = {"RGBA", "SHADE", "GRAY", "PACKED"};
+
+// Converts rendered lines to the observation format of an instance: RGBA (4 bytes per pixel), shade index (1 byte),
+// grayscale (1 byte) or packed shades (2 bits, leftmost pixel in the low bits), optionally cropped and box filtered.
+// CGB colours are turned into shades and grey levels by their luminance.
+struct FrameOutput
+{
+    static constexpr uint32_t SCREEN_WIDTH = 160;
+    static constexpr uint32_t SCREEN_HEIGHT = 144;
+
+    // Lines are given as 2 bitplanes of shades or colour indices, then in colour mode 3 bitplanes of palette numbers
+    // and one set for sprite pixels, which gives a 6 bits index in the colour tables
+    static constexpr size_t PLANES = 6;
+    static constexpr size_t COLORS = 64;
+
+    bool configure(PixelFormat format, uint32_t downsample, uint32_t crop_x = 0, uint32_t crop_y = 0,
+                   uint32_t crop_width = SCREEN_WIDTH, uint32_t crop_height = SCREEN_HEIGHT);
+    void clear();
+    void set_color(size_t index, uint32_t rgba);
+    void write_line(uint8_t ly, const Bitplane* planes, bool changed);
+
+    inline size_t size() const
+    {
+        return stride * height;
+    }
+
+    PixelFormat format = PixelFormat::RGBA;
+    uint32_t downsample = 1;
+    uint32_t crop_x = 0;
+    uint32_t crop_y = 0;
+    uint32_t width = SCREEN_WIDTH;
+    uint32_t height = SCREEN_HEIGHT;
+    uint32_t stride = SCREEN_WIDTH * 4;
+
+    bool color = false;
+    uint32_t colors[COLORS] = {};
+    uint8_t grays[COLORS] = {};
+    uint8_t shades[COLORS] = {};
+
+    alignas(64) uint8_t data[SCREEN_WIDTH * SCREEN_HEIGHT * 4] = {};
+    uint16_t row_sums[3][SCREEN_WIDTH] = {};
+    bool row_changed = false;
+
+private:
+    void write_row(const uint8_t* levels, uint8_t* out) const;
+};
@@ -2,25 +2,177 @@
 
 #include <cstdio>
 #include <cstring>
+#include <utility>
 
+#include "arena.h"
 #include "interrupt.h"
+#include "link.h"
 #include "timer.h"
 
-Gameboy gb;
+void* Gameboy::operator new(size_t size)
+{
+    return Arena::allocate(size);
+}
+
+void Gameboy::operator delete(void* p, size_t size)
+{
+    Arena::free(p, size);
+}
+
+Gameboy::Gameboy(const Gameboy& other)
+{
+    *this = other;
+}
+
+Gameboy::Gameboy(Gameboy&& other) noexcept
+    : cpu(other.cpu)
+    , interrupts(other.interrupts)
+    , timer(other.timer)
+    , scheduler(other.scheduler)
+    , dma(other.dma)
+    , hdma(other.hdma)
+    , memory(std::move(other.memory))
+    , apu(std::move(other.apu))
+    , ppu(std::move(other.ppu))
+    , serial(std::move(other.serial))
+    , cart_info(other.cart_info)
+    , snapshot_base(std::move(other.snapshot_base))
+    , stepping(other.stepping)
+{
+    take_over(other);
+}
+
+Gameboy::~Gameboy()
+{
+    unplug_link();
+}
+
+Gameboy& Gameboy::operator=(const Gameboy& other)
+{
+    if (this == &other)
+    {
+        return *this;
+    }
+
+    std::vector<std::shared_ptr<SerialSink>> sinks = std::move(serial.sinks);
+    LinkCable* link = serial.link;
+    std::shared_ptr<AudioCapture> capture = std::move(apu.capture);
+    std::shared_ptr<RenderThread> render_thread = std::move(ppu.render_thread);
+
+    copy_state(other);
+
+    serial.sinks = std::move(sinks);
+    serial.link = link;
+    apu.capture = std::move(capture);
+    ppu.render_thread = std::move(render_thread);
+    ppu.restore(*this);
+    return *this;
+}
+
+Gameboy& Gameboy::operator=(Gameboy&& other) noexcept
+{
+    if (this == &other)
+    {
+        return *this;
+    }
+
+    unplug_link();
+    cpu = other.cpu;
+    interrupts = other.interrupts;
+    timer = other.timer;
+    scheduler = other.scheduler;
+    dma = other.dma;
+    hdma = other.hdma;
+    memory = std::move(other.memory);
+    apu = std::move(other.apu);
+    ppu = std::move(other.ppu);
+    serial = std::move(other.serial);
+    cart_info = other.cart_info;
+    snapshot_base = std::move(other.snapshot_base);
+    stepping = other.stepping;
+
+    take_over(other);
+    return *this;
+}
+
+// The members were moved from `other`, the audio buffer, the host resources and the renderer caches came along. Only
+// the pointers into the instance are rebuilt, `other` can then only be destroyed or assigned to
+void Gameboy::take_over(Gameboy& other)
+{
+    memory.owner = this;
+    memory.map_pages();
+    ppu.attach(*this);
+
+    other.serial.link = nullptr;
+    if (serial.link)
+    {
+        for (Gameboy*& end : serial.link->ends)
+        {
+            end = end == &other ? this : end;
+        }
+    }
+}
+
+// Every member but the host resources, which the caller sets afterwards
+void Gameboy::copy_state(const Gameboy& other)
+{
+    cart_info = other.cart_info;
+    scheduler = other.scheduler;
+    memory = other.memory;
+    cpu = other.cpu;
+    interrupts = other.interrupts;
+    timer = other.timer;
+    serial.sb = other.serial.sb;
+    serial.sc = other.serial.sc;
+    serial.sent = other.serial.sent;
+    serial.dropped = other.serial.dropped;
+    apu = other.apu;
+    apu.capture = nullptr;
+    ppu = other.ppu;
+    ppu.render_thread = nullptr;
+    dma = other.dma;
+    hdma = other.hdma;
+    snapshot_base = other.snapshot_base;
+    stepping = other.stepping;
+
+    memory.owner = this;
+    memory.map_pages();
+}
 
-Gameboy::Gameboy()
+// Both instances are unplugged, the cable cannot run anymore and only has to be destroyed
+void Gameboy::unplug_link()
 {
-    init_interrupts(*this);
-    init_timer(*this);
+    if (!serial.link)
+    {
+        return;
+    }
+    for (Gameboy*& end : serial.link->ends)
+    {
+        if (end && end != this)
+        {
+            end->serial.link = nullptr;
+            end->scheduler.cancel(Event::SYNC);
+        }
+        end = nullptr;
+    }
+    serial.link = nullptr;
 }
 
 void Gameboy::reset()
 {
+    memory.owner = this;
     memory.reset(cart_info);
     cpu.reset(cart_info);
+    scheduler.reset();
+    interrupts.reset();
+    timer.reset(*this);
+    apu.reset(*this);
     ppu.reset(*this);
+    hdma.reset();
+    dma.reset();
+    serial.reset(*this);
+    snapshot_base = nullptr;
     stepping = true;
-    serial_data.clear();
 }
 
 bool Gameboy::load_rom(const char* path)
@@ -30,15 +182,14 @@ bool Gameboy::load_rom(const char* path)
     {
         return false;
     }
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    fread(memory.data, 1, size, file);
+    // Without a mapper only the two first banks are addressable
+    auto rom = std::make_shared<Rom>();
+    fread(rom->data, 1, sizeof(rom->data), file);
     fclose(file);
 
     for (size_t i = 0; i < 16; ++i)
     {
-        char c = memory.read(0x134 + i);
+        char c = rom->data[0x134 + i];
         if (c < 'A' || c > 'Z')
         {
             break;
@@ -46,18 +197,19 @@ bool Gameboy::load_rom(const char* path)
         cart_info.title[i] = c;
     }
 
-    cart_info.cgb = memory[0x143];
+    cart_info.cgb = rom->data[0x143];
     if (cart_info.cgb != 0x80 && cart_info.cgb != 0xc0)
     {
         cart_info.cgb = 0;
     }
 
-    cart_info.sgb = memory[0x146];
-    cart_info.cartridge_type = memory[0x147];
-    cart_info.rom_size = memory[0x148];
-    cart_info.ram_size = memory[0x149];
-    cart_info.header_checksum = memory[0x14d];
+    cart_info.sgb = rom->data[0x146];
+    cart_info.cartridge_type = rom->data[0x147];
+    cart_info.rom_size = rom->data[0x148];
+    cart_info.ram_size = rom->data[0x149];
+    cart_info.header_checksum = rom->data[0x14d];
 
+    memory.rom = std::move(rom);
     reset();
 
     return true;
@@ -72,14 +224,82 @@ void Gameboy::step()
     }
     else
     {
-        cpu.cycles += 1;
-        cpu.halted = !interrupt_pending();
+        // Interrupts are only raised by events, a halted CPU skips to the next one
+        uint64_t next = scheduler.next;
+        cpu.cycles += next != Scheduler::NEVER && next > scheduler.now ? (next - scheduler.now + 3) / 4 : 1;
     }
+    finish_step();
+}
 
-    timer_tick(cpu.cycles);
+// Advances time by the cycles of the instruction, then runs the events and interrupts that became due
+void Gameboy::finish_step()
+{
+    scheduler.now += cpu.cycles * 4;
     cpu.cycles = 0;
-    handle_interrupts(*this);
-    process_serial_data();
+    if (scheduler.pending())
+    {
+        run_events();
+    }
+    if (interrupts.pending())
+    {
+        cpu.halted = false;
+        if (cpu.ime)
+        {
+            dispatch_interrupt(*this);
+        }
+    }
+    if (cpu.ei_delay > 0 && --cpu.ei_delay == 0)
+    {
+        cpu.ime = true;
+    }
+}
+
+void Gameboy::run_frame()
+{
+    uint64_t frame = ppu.frame_count;
+    uint64_t deadline = scheduler.now + PPU::DOTS_PER_FRAME;
+    while (ppu.frame_count == frame && scheduler.now < deadline)
+    {
+        step();
+    }
+    serial.drain();
+    apu.capture_frame(*this);
+}
+
+void Gameboy::run_events()
+{
+    while (scheduler.pending())
+    {
+        Event event = scheduler.next_event();
+        uint64_t when = scheduler.deadlines[event];
+        scheduler.cancel(event);
+        switch (event)
+        {
+        case Event::PPU:
+            ppu.on_event(*this, when);
+            break;
+        case Event::TIMER:
+            timer.on_event(*this, when);
+            break;
+        case Event::SERIAL:
+            serial.on_event(*this);
+            break;
+        case Event::HDMA:
+            hdma.on_event(*this, when);
+            break;
+        case Event::OAM_DMA:
+            dma.on_event(*this);
+            break;
+        case Event::APU:
+            apu.on_event(*this, when);
+            break;
+        case Event::SYNC:
+            break;
+        default:
+            ASSERT_MSG(false, "Unknown event");
+            break;
+        }
+    }
 }
 
 uint32_t Gameboy::execute_instruction(const Instr& instr)
@@ -93,13 +313,3 @@ Instr Gameboy::fetch_instruction()
     uint8_t opcode = memory.read(cpu.pc++);
     return instructions[opcode];
 }
-
-void Gameboy::process_serial_data()
-{
-    if (memory[0xff02] == 0x81)
-    {
-        char c = memory[0xff01];
-        serial_data.push_back(c);
-        memory[0xff02] = 0;
-    }
-}
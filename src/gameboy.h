@@ -5,6 +5,14 @@
 #include "ppu.h"
 #include "instruction.h"
 #include "dma.h"
+#include "hdma.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "interrupt.h"
+#include "serial.h"
+#include "apu.h"
+
+struct Snapshot;
 
 struct CartInfo
 {
@@ -17,27 +25,56 @@ struct CartInfo
     uint8_t header_checksum = 0;
 };
 
-struct Gameboy
+// Owns all of its state, instances can run concurrently on different threads. A copy is an independent machine in the
+// same state: the pointers into the instance are rebuilt and the host resources (serial sinks, link cable, audio
+// capture and render thread) are not copied, an assignment keeps those of the target. A move takes them along, a
+// destroyed instance is unplugged from its link cable.
+// Instances created with new come from the arena, the members are ordered from the hottest to the coldest
+struct alignas(64) Gameboy
 {
-    Gameboy();
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
+
+    Gameboy() = default;
+    Gameboy(const Gameboy& other);
+    Gameboy(Gameboy&& other) noexcept;
+    ~Gameboy();
+    Gameboy& operator=(const Gameboy& other);
+    Gameboy& operator=(Gameboy&& other) noexcept;
 
     void reset();
     bool load_rom(const char* path);
 
     void step();
+    void finish_step();
+    void run_frame();
+    void run_events();
     uint32_t execute_instruction(const Instr& instr);
     Instr fetch_instruction();
-    void process_serial_data();
 
-    CartInfo cart_info;
-    Memory memory;
+    // Read or written by every instruction: the CPU, interrupts and timer take the first two cache lines
     CPU cpu;
-    PPU ppu;
+    Interrupts interrupts;
+    Timer timer;
+    Scheduler scheduler;
     DMA dma;
+    HDMA hdma;
+    Memory memory;
+
+    APU apu;
+    PPU ppu;
+    Serial serial;
+
+    // Cold, only touched on load, reset, snapshots and by the frontend
+    CartInfo cart_info;
+
+    // Memory pages marked dirty are relative to this snapshot
+    std::shared_ptr<const Snapshot> snapshot_base;
 
     bool stepping = true;
 
-    std::string serial_data;
+private:
+    void copy_state(const Gameboy& other);
+    void take_over(Gameboy& other);
+    void unplug_link();
 };
-
-extern Gameboy gb;
@@ -0,0 +1,107 @@
+#include "hdma.h"
+
+#include <algorithm>
+
+#include "gameboy.h"
+
+void HDMA::reset()
+{
+    source = 0;
+    destination = 0;
+    blocks_left = 0;
+    active = false;
+}
+
+uint8_t HDMA::read(uint16_t addr) const
+{
+    if (addr != HDMA5)
+    {
+        return 0xff;
+    }
+    // Bit 7 is cleared while an HBlank transfer is running, 0xff once a transfer is complete
+    return (active ? 0x00 : 0x80) | ((blocks_left - 1) & 0x7f);
+}
+
+void HDMA::write(Gameboy& gb, uint16_t addr, uint8_t value)
+{
+    switch (addr)
+    {
+    case HDMA1:
+        source = (source & 0x00ff) | (value << 8);
+        break;
+    case HDMA2:
+        source = (source & 0xff00) | (value & 0xf0);
+        break;
+    case HDMA3:
+        destination = Memory::VRAM_BEGIN | ((value & 0x1f) << 8) | (destination & 0x00ff);
+        break;
+    case HDMA4:
+        destination = (destination & 0xff00) | (value & 0xf0);
+        break;
+    case HDMA5:
+        if (active && !bit(value, 7))
+        {
+            active = false;
+            gb.scheduler.cancel(Event::HDMA);
+            break;
+        }
+        blocks_left = (value & 0x7f) + 1;
+        if (bit(value, 7))
+        {
+            active = true;
+            schedule_next(gb, gb.scheduler.now);
+        }
+        else
+        {
+            gb.cpu.cycles += blocks_left * BLOCK_CYCLES;
+            copy(gb, blocks_left);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void HDMA::on_event(Gameboy& gb, uint64_t when)
+{
+    // Paused while the LCD is off, turning it back on schedules the next block
+    if (!bit(gb.memory[LCD::LCDC], 7))
+    {
+        return;
+    }
+
+    // The CPU is stalled while the block is copied, the cycles are charged to its next step
+    gb.cpu.cycles += BLOCK_CYCLES;
+    copy(gb, 1);
+    if (blocks_left == 0)
+    {
+        active = false;
+        return;
+    }
+    schedule_next(gb, when + 1);
+}
+
+void HDMA::schedule_next(Gameboy& gb, uint64_t after)
+{
+    uint64_t hblank = gb.ppu.next_hblank(gb, after);
+    if (hblank != Scheduler::NEVER)
+    {
+        gb.scheduler.schedule(Event::HDMA, hblank);
+    }
+}
+
+void HDMA::copy(Gameboy& gb, uint32_t blocks)
+{
+    // Copies page by page from the mapped source, the destination wraps within VRAM
+    uint32_t size = blocks * BLOCK_SIZE;
+    while (size > 0)
+    {
+        uint16_t vram_offset = destination - Memory::VRAM_BEGIN;
+        uint32_t n = std::min({size, 0x100u - (source & 0xff), static_cast<uint32_t>(Memory::VRAM_SIZE - vram_offset)});
+        gb.ppu.write_block(gb, destination, gb.memory.mapped_pages[source >> 8] + (source & 0xff), n);
+        source += n;
+        destination = Memory::VRAM_BEGIN + (vram_offset + n) % Memory::VRAM_SIZE;
+        size -= n;
+    }
+    blocks_left -= blocks;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+
+struct Gameboy;
+
+// CGB VRAM DMA. General purpose transfers are copied at once and stall the CPU for their whole length, HBlank
+// transfers copy one 16 bytes block at the start of each HBlank
+struct HDMA
+{
+    static constexpr uint16_t HDMA1 = 0xff51;
+    static constexpr uint16_t HDMA2 = 0xff52;
+    static constexpr uint16_t HDMA3 = 0xff53;
+    static constexpr uint16_t HDMA4 = 0xff54;
+    static constexpr uint16_t HDMA5 = 0xff55;
+
+    static constexpr uint16_t BLOCK_SIZE = 16;
+    static constexpr uint32_t BLOCK_CYCLES = 8;
+
+    void reset();
+    uint8_t read(uint16_t addr) const;
+    void write(Gameboy& gb, uint16_t addr, uint8_t value);
+    void on_event(Gameboy& gb, uint64_t when);
+    void schedule_next(Gameboy& gb, uint64_t after);
+
+    uint16_t source = 0;
+    uint16_t destination = 0;
+    uint8_t blocks_left = 0;
+    bool active = false;
+
+private:
+    void copy(Gameboy& gb, uint32_t blocks);
+};
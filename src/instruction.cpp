@@ -1871,7 +1871,7 @@ static std::string instr_jp_r16_str(Gameboy&, const Instr& instr)
 
 static uint32_t instr_ei(Gameboy& gb, const Instr&)
 {
-    gb.cpu.enable_interrupts = true;
+    gb.cpu.ei_delay = 1;
     return 1;
 }
 
@@ -1883,6 +1883,7 @@ static std::string instr_ei_str(Gameboy&, const Instr&)
 static uint32_t instr_di(Gameboy& gb, const Instr&)
 {
     gb.cpu.ime = false;
+    gb.cpu.ei_delay = 0;
     return 1;
 }
 
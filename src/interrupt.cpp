@@ -4,70 +4,56 @@
 
 static constexpr uint16_t interrupt_addresses[] = {0x40, 0x48, 0x50, 0x58, 0x60};
 
-static uint8_t* int_enable = nullptr;
-static uint8_t* int_flag = nullptr;
-
-void init_interrupts(Gameboy& gb)
+void Interrupts::reset()
 {
-    int_enable = &gb.memory[0xffff];
-    int_flag = &gb.memory[0xff0f];
+    enable = 0x00;
+    flag = 0xe1;
+    update();
 }
 
-static size_t get_next_interrupt_index()
+uint8_t Interrupts::read(uint16_t addr) const
 {
-    size_t i = 0;
-    for (; i < static_cast<size_t>(Interrupt::Count); ++i)
-    {
-        if (bit(*int_flag, i) && bit(*int_enable, i))
-        {
-            break;
-        }
-    }
-    return i;
+    return addr == IF ? flag | 0xe0 : enable;
 }
 
-static void execute_interrupts(Gameboy& gb)
+void Interrupts::write(uint16_t addr, uint8_t value)
 {
-    size_t i = get_next_interrupt_index();
-    if (i == static_cast<size_t>(Interrupt::Count))
+    if (addr == IF)
     {
-        return;
+        flag = value;
     }
-
-    set_bit(*int_flag, i, 0);
-    gb.cpu.ime = false;
-
-    gb.cpu.sp -= 2;
-    gb.memory.write16(gb.cpu.sp, gb.cpu.pc);
-    gb.cpu.pc = interrupt_addresses[i];
-    gb.cpu.cycles += 5;
+    else
+    {
+        enable = value;
+    }
+    update();
 }
 
-void handle_interrupts(Gameboy& gb)
+void Interrupts::request(Interrupt interrupt)
 {
-    if (gb.cpu.ime)
-    {
-        execute_interrupts(gb);
-        gb.cpu.enable_interrupts = false;
-    }
-    if (gb.cpu.enable_interrupts)
-    {
-        gb.cpu.ime = true;
-        gb.cpu.enable_interrupts = false;
-    }
+    set_bit(flag, static_cast<size_t>(interrupt), 1);
+    update();
 }
 
-void request_interrupt(Interrupt interrupt)
+void Interrupts::acknowledge(Interrupt interrupt)
 {
-    set_bit(*int_flag, static_cast<size_t>(interrupt), 1);
+    set_bit(flag, static_cast<size_t>(interrupt), 0);
+    update();
 }
 
-bool interrupt_enable(Interrupt interrupt)
+bool Interrupts::enabled(Interrupt interrupt) const
 {
-    return bit(*int_enable, static_cast<size_t>(interrupt));
+    return bit(enable, static_cast<size_t>(interrupt));
 }
 
-bool interrupt_pending()
+void dispatch_interrupt(Gameboy& gb)
 {
-    return *int_enable & *int_flag;
+    Interrupt interrupt = gb.interrupts.next();
+    gb.interrupts.acknowledge(interrupt);
+    gb.cpu.ime = false;
+
+    gb.cpu.sp -= 2;
+    gb.memory.write16(gb.cpu.sp, gb.cpu.pc);
+    gb.cpu.pc = interrupt_addresses[static_cast<size_t>(interrupt)];
+    gb.cpu.cycles += 5;
 }
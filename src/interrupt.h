@@ -1,5 +1,7 @@
 #pragma once
 
+#include <bit>
+
 #include "common.h"
 #include "enum_array.h"
 
@@ -17,8 +19,39 @@ enum class Interrupt
 
 static constexpr EnumArray<Interrupt, const char*> interrupt_str = {"VBLANK", "LCD_STAT", "TIMER", "SERIAL", "JOYPAD"};
 
-void init_interrupts(Gameboy& gb);
-void handle_interrupts(Gameboy& gb);
-void request_interrupt(Interrupt interrupt);
-bool interrupt_enable(Interrupt interrupt);
-bool interrupt_pending();
+// IE and IF, IE & IF is cached so that the CPU only looks at interrupts when one is pending
+struct Interrupts
+{
+    static constexpr uint16_t IF = 0xff0f;
+    static constexpr uint16_t IE = 0xffff;
+
+    void reset();
+    uint8_t read(uint16_t addr) const;
+    void write(uint16_t addr, uint8_t value);
+    void request(Interrupt interrupt);
+    void acknowledge(Interrupt interrupt);
+    bool enabled(Interrupt interrupt) const;
+
+    inline bool pending() const
+    {
+        return pending_mask != 0;
+    }
+
+    // Lower bits have priority
+    inline Interrupt next() const
+    {
+        return static_cast<Interrupt>(std::countr_zero(pending_mask));
+    }
+
+    uint8_t enable = 0;
+    uint8_t flag = 0;
+    uint8_t pending_mask = 0;
+
+private:
+    inline void update()
+    {
+        pending_mask = enable & flag & 0x1f;
+    }
+};
+
+void dispatch_interrupt(Gameboy& gb);
@@ -0,0 +1,139 @@
+#include "link.h"
+
+#include <algorithm>
+
+#include "gameboy.h"
+
+LinkCable::LinkCable(Gameboy& a, Gameboy& b, uint64_t _quantum) : ends{&a, &b}, quantum(_quantum)
+{
+    for (size_t i = 0; i < 2; ++i)
+    {
+        base[i] = ends[i]->scheduler.now;
+        ends[i]->serial.link = this;
+    }
+}
+
+LinkCable::~LinkCable()
+{
+    for (Gameboy* gb : ends)
+    {
+        if (gb)
+        {
+            gb->serial.link = nullptr;
+            gb->scheduler.cancel(Event::SYNC);
+        }
+    }
+}
+
+void LinkCable::run(uint64_t dots)
+{
+    ASSERT_MSG(ends[0] && ends[1], "The link cable was unplugged");
+    uint64_t end = time + dots;
+    while (time < end)
+    {
+        uint64_t boundary = std::min(end, time + std::min(quantum, max_quantum()));
+        if (in_flight)
+        {
+            boundary = std::min(boundary, std::max(completion, time + 1));
+        }
+
+        // An instance that starts a transfer stops right away so that the other one catches up before it completes
+        size_t first = in_flight ? 1 - master : 0;
+        run_until(first, boundary);
+        run_until(1 - first, boundary);
+        if (local_time(0) >= boundary && local_time(1) >= boundary)
+        {
+            time = boundary;
+        }
+    }
+
+    for (Gameboy* gb : ends)
+    {
+        gb->serial.drain();
+    }
+}
+
+void LinkCable::run_frame()
+{
+    run(PPU::DOTS_PER_FRAME);
+}
+
+void LinkCable::start(const Gameboy& gb, uint8_t byte, uint64_t when)
+{
+    if (in_flight)
+    {
+        return;
+    }
+
+    master = side(gb);
+    master_byte = byte;
+    slave_byte = 0xff;
+    completion = when - base[master];
+    in_flight = true;
+    stop = true;
+
+    Gameboy& slave = *ends[1 - master];
+    slave.scheduler.schedule(Event::SERIAL, completion + base[1 - master]);
+    if (slave.scheduler.pending())
+    {
+        slave.run_events();
+    }
+}
+
+bool LinkCable::cancel(const Gameboy& gb)
+{
+    if (!in_flight || side(gb) != master)
+    {
+        return false;
+    }
+    in_flight = false;
+    ends[1 - master]->scheduler.cancel(Event::SERIAL);
+    return true;
+}
+
+uint8_t LinkCable::exchange(const Gameboy& gb, uint8_t byte)
+{
+    if (!in_flight)
+    {
+        return 0xff;
+    }
+    if (side(gb) == master)
+    {
+        in_flight = false;
+        return slave_byte;
+    }
+    slave_byte = byte;
+    return master_byte;
+}
+
+size_t LinkCable::side(const Gameboy& gb) const
+{
+    return &gb == ends[0] ? 0 : 1;
+}
+
+uint64_t LinkCable::local_time(size_t i) const
+{
+    return ends[i]->scheduler.now - base[i];
+}
+
+uint64_t LinkCable::max_quantum() const
+{
+    if (!bit(ends[0]->serial.sc, 7) && !bit(ends[1]->serial.sc, 7))
+    {
+        return UINT64_MAX;
+    }
+    bool fast = ends[0]->memory.cgb || ends[1]->memory.cgb;
+    return 8 * (fast ? Serial::FAST_DOTS_PER_BIT : Serial::DOTS_PER_BIT);
+}
+
+void LinkCable::run_until(size_t i, uint64_t boundary)
+{
+    // The sync event keeps a halted CPU from skipping past the boundary
+    Gameboy& gb = *ends[i];
+    gb.scheduler.schedule(Event::SYNC, boundary + base[i]);
+    while (local_time(i) < boundary && !stop)
+    {
+        gb.step();
+    }
+    stop = false;
+}
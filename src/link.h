@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+struct Gameboy;
+
+// Connects the serial ports of two instances and runs them in lockstep. While no transfer is in flight the instances
+// take turns running for a quantum. While an end has SC bit 7 set, waiting for a transfer or running one, the quantum is
+// capped by the shortest transfer so that the instance ahead never passes the end of a transfer started by the other
+// one. An end that only becomes ready within a quantum takes part in a transfer of that quantum with the state it has
+// when it gets there. During a transfer both stop at its completion and the slave runs first, so that the master
+// receives the byte the slave had at that time.
+struct LinkCable
+{
+    static constexpr uint64_t DEFAULT_QUANTUM = 4096;
+
+    LinkCable(Gameboy& a, Gameboy& b, uint64_t quantum = DEFAULT_QUANTUM);
+    ~LinkCable();
+
+    LinkCable(const LinkCable&) = delete;
+    LinkCable& operator=(const LinkCable&) = delete;
+
+    void run(uint64_t dots);
+    void run_frame();
+
+    // Called by the serial ports
+    void start(const Gameboy& gb, uint8_t byte, uint64_t when);
+    bool cancel(const Gameboy& gb);
+    uint8_t exchange(const Gameboy& gb, uint8_t byte);
+
+    Gameboy* ends[2] = {};
+    uint64_t base[2] = {};
+    uint64_t quantum = DEFAULT_QUANTUM;
+    uint64_t time = 0;
+
+    bool in_flight = false;
+    size_t master = 0;
+    uint8_t master_byte = 0xff;
+    uint8_t slave_byte = 0xff;
+    uint64_t completion = 0;
+    bool stop = false;
+
+private:
+    size_t side(const Gameboy& gb) const;
+    uint64_t local_time(size_t i) const;
+    uint64_t max_quantum() const;
+    void run_until(size_t i, uint64_t boundary);
+};
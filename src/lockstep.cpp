@@ -0,0 +1,537 @@
+#include "lockstep.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+static constexpr size_t REG_B = 0;
+static constexpr size_t REG_C = 1;
+static constexpr size_t REG_D = 2;
+static constexpr size_t REG_E = 3;
+static constexpr size_t REG_H = 4;
+static constexpr size_t REG_L = 5;
+static constexpr size_t REG_F = 6;
+static constexpr size_t REG_A = 7;
+
+static constexpr uint8_t FLAG_Z = 0x80;
+static constexpr uint8_t FLAG_N = 0x40;
+static constexpr uint8_t FLAG_H = 0x20;
+static constexpr uint8_t FLAG_C = 0x10;
+
+enum class VectorOp : uint8_t
+{
+    NONE,
+    NOP,
+    LD_R_R,
+    LD_R_D8,
+    INC_R,
+    DEC_R,
+    LD_RR_D16,
+    INC_RR,
+    DEC_RR,
+    ALU_R,
+    ALU_D8,
+    JR,
+    JP,
+    RLCA,
+    RRCA,
+    RLA,
+    RRA,
+    CPL,
+    SCF,
+    CCF,
+};
+
+// Length and cycles when a branch is not taken
+struct VectorOpInfo
+{
+    VectorOp op = VectorOp::NONE;
+    uint8_t length = 0;
+    uint8_t cycles = 0;
+};
+
+// Instructions that only read their operands from the instruction stream and only touch registers
+static constexpr auto vector_ops = [] {
+    std::array<VectorOpInfo, 0x100> ops = {};
+    for (uint8_t r = 0; r < 8; ++r)
+    {
+        for (uint8_t src = 0; src < 8; ++src)
+        {
+            if (src != REG_F)
+            {
+                ops[0x80 | r << 3 | src] = {VectorOp::ALU_R, 1, 1};
+                if (r != REG_F)
+                {
+                    ops[0x40 | r << 3 | src] = {VectorOp::LD_R_R, 1, 1};
+                }
+            }
+        }
+        ops[0xc6 | r << 3] = {VectorOp::ALU_D8, 2, 2};
+        if (r != REG_F)
+        {
+            ops[0x04 | r << 3] = {VectorOp::INC_R, 1, 1};
+            ops[0x05 | r << 3] = {VectorOp::DEC_R, 1, 1};
+            ops[0x06 | r << 3] = {VectorOp::LD_R_D8, 2, 2};
+        }
+    }
+    for (uint8_t rr = 0; rr < 4; ++rr)
+    {
+        ops[0x01 | rr << 4] = {VectorOp::LD_RR_D16, 3, 3};
+        ops[0x03 | rr << 4] = {VectorOp::INC_RR, 1, 2};
+        ops[0x0b | rr << 4] = {VectorOp::DEC_RR, 1, 2};
+        ops[0x20 | rr << 3] = {VectorOp::JR, 2, 2};
+        ops[0xc2 | rr << 3] = {VectorOp::JP, 3, 3};
+    }
+    ops[0x00] = {VectorOp::NOP, 1, 1};
+    ops[0x18] = {VectorOp::JR, 2, 2};
+    ops[0xc3] = {VectorOp::JP, 3, 3};
+    ops[0x07] = {VectorOp::RLCA, 1, 1};
+    ops[0x0f] = {VectorOp::RRCA, 1, 1};
+    ops[0x17] = {VectorOp::RLA, 1, 1};
+    ops[0x1f] = {VectorOp::RRA, 1, 1};
+    ops[0x2f] = {VectorOp::CPL, 1, 1};
+    ops[0x37] = {VectorOp::SCF, 1, 1};
+    ops[0x3f] = {VectorOp::CCF, 1, 1};
+    return ops;
+}();
+
+// Masks are 0 or 0xff so that selects compile to blends
+static inline uint8_t select(uint8_t mask, uint8_t a, uint8_t b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+static inline uint16_t select16(uint8_t mask, uint16_t a, uint16_t b)
+{
+    uint16_t wide = uint16_t(int16_t(int8_t(mask)));
+    return (a & wide) | (b & ~wide);
+}
+
+// `op` returns the result in the low byte and the flags in the high byte, the low nibble of F is preserved as the
+// interpreter does
+template <bool STORE, typename Y, typename Op>
+static void alu(size_t n, const uint8_t* mask, uint8_t* a, uint8_t* f, Y y, Op op)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint16_t res = op(a[i], y(i), f[i]);
+        if constexpr (STORE)
+        {
+            a[i] = select(mask[i], uint8_t(res), a[i]);
+        }
+        f[i] = select(mask[i], uint8_t(res >> 8) | (f[i] & 0x0f), f[i]);
+    }
+}
+
+template <typename Y>
+static void alu_op(uint8_t op, size_t n, const uint8_t* mask, uint8_t* a, uint8_t* f, Y y)
+{
+    auto flags = [](bool z, bool n, bool h, bool c) {
+        return uint16_t((z ? FLAG_Z : 0) | (n ? FLAG_N : 0) | (h ? FLAG_H : 0) | (c ? FLAG_C : 0)) << 8;
+    };
+
+    switch (op)
+    {
+    case 0: // ADD
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t) {
+            uint16_t res = x + v;
+            return uint16_t(uint8_t(res) | flags(uint8_t(res) == 0, 0, ((x & 0x0f) + (v & 0x0f)) & 0x10, res > 0xff));
+        });
+        break;
+    case 1: // ADC
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t fl) {
+            uint16_t carry = (fl >> 4) & 1;
+            uint16_t res = x + v + carry;
+            return uint16_t(uint8_t(res) |
+                            flags(uint8_t(res) == 0, 0, ((x & 0x0f) + (v & 0x0f) + carry) & 0x10, res > 0xff));
+        });
+        break;
+    case 2: // SUB
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t) {
+            uint16_t res = x - v;
+            return uint16_t(uint8_t(res) | flags(uint8_t(res) == 0, 1, (x & 0x0f) < (v & 0x0f), x < v));
+        });
+        break;
+    case 3: // SBC
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t fl) {
+            uint16_t res = x - v - ((fl >> 4) & 1);
+            return uint16_t(uint8_t(res) | flags(uint8_t(res) == 0, 1, (x ^ v ^ res) & 0x10, res & 0x100));
+        });
+        break;
+    case 4: // AND
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t) {
+            uint8_t res = x & v;
+            return uint16_t(res | flags(res == 0, 0, 1, 0));
+        });
+        break;
+    case 5: // XOR
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t) {
+            uint8_t res = x ^ v;
+            return uint16_t(res | flags(res == 0, 0, 0, 0));
+        });
+        break;
+    case 6: // OR
+        alu<true>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t) {
+            uint8_t res = x | v;
+            return uint16_t(res | flags(res == 0, 0, 0, 0));
+        });
+        break;
+    default: // CP
+        alu<false>(n, mask, a, f, y, [&](uint16_t x, uint16_t v, uint8_t) {
+            return flags(x == v, 1, (x & 0x0f) < (v & 0x0f), x < v);
+        });
+        break;
+    }
+}
+
+void Lockstep::add(const Gameboy& gb)
+{
+    ASSERT_MSG(gb.memory.rom != nullptr, "Lanes must run a ROM");
+    ASSERT_MSG(lanes.empty() || lanes[0].memory.rom == gb.memory.rom ||
+                   memcmp(lanes[0].memory.rom->data, gb.memory.rom->data, Memory::ROM_SIZE) == 0,
+               "Lanes must run the same ROM");
+    lanes.push_back(gb);
+
+    size_t n = lanes.size();
+    for (auto& reg : r8)
+    {
+        reg.resize(n);
+    }
+    sp.resize(n);
+    pc.resize(n);
+    cycles.resize(n);
+    mask.resize(n);
+    group.resize(n);
+    running.resize(n);
+    divergence.resize(n);
+    frame.resize(n);
+    deadline.resize(n);
+}
+
+void Lockstep::run_frame()
+{
+    size_t n = lanes.size();
+    size_t active = n;
+    for (size_t i = 0; i < n; ++i)
+    {
+        load(i);
+        running[i] = 1;
+        divergence[i] = 0;
+        frame[i] = lanes[i].ppu.frame_count;
+        deadline[i] = lanes[i].scheduler.now + PPU::DOTS_PER_FRAME;
+    }
+
+    while (active > 0)
+    {
+        // The lowest PC first, lanes that branched forward wait for the others to catch up
+        uint32_t leader = 0x10000;
+        for (size_t i = 0; i < n; ++i)
+        {
+            leader = std::min<uint32_t>(leader, running[i] ? pc[i] : 0x10000);
+        }
+        size_t first = n;
+        for (size_t i = 0; i < n; ++i)
+        {
+            group[i] = running[i] && pc[i] == leader ? 0xff : 0;
+            mask[i] = group[i];
+            first = group[i] && first == n ? i : first;
+        }
+
+        const uint8_t* rom = lanes[first].memory.rom->data;
+        VectorOpInfo info = leader < Memory::ROM_SIZE ? vector_ops[rom[leader]] : VectorOpInfo{};
+        if (info.op != VectorOp::NONE && leader + info.length <= Memory::ROM_SIZE)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (mask[i] && (lanes[i].cpu.halted || lanes[i].memory.bus_blocked))
+                {
+                    mask[i] = 0;
+                    scalar_step(i);
+                }
+            }
+            execute_vector(rom[leader], rom + leader + 1);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (!mask[i])
+                {
+                    continue;
+                }
+                stats.vector_instructions++;
+                Gameboy& gb = lanes[i];
+                gb.cpu.cycles += cycles[i];
+                uint64_t now = gb.scheduler.now + gb.cpu.cycles * 4;
+                if (now < gb.scheduler.next && !gb.interrupts.pending() && gb.cpu.ei_delay == 0)
+                {
+                    gb.scheduler.now = now;
+                    gb.cpu.cycles = 0;
+                    continue;
+                }
+                store(i);
+                gb.finish_step();
+                load(i);
+            }
+            stats.vector_steps++;
+        }
+        else
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (group[i])
+                {
+                    scalar_step(i);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!running[i])
+            {
+                continue;
+            }
+            if (group[i])
+            {
+                divergence[i] = 0;
+                if (frame_done(i))
+                {
+                    running[i] = 0;
+                    active--;
+                }
+            }
+            else if (++divergence[i] > MAX_DIVERGENCE)
+            {
+                // Too far from the others, finish the frame alone
+                store(i);
+                while (!frame_done(i))
+                {
+                    lanes[i].step();
+                    stats.scalar_instructions++;
+                }
+                // The arrays are stored back into every lane once the frame is done
+                load(i);
+                stats.demoted_frames++;
+                running[i] = 0;
+                active--;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        store(i);
+        lanes[i].serial.drain();
+        lanes[i].apu.capture_frame(lanes[i]);
+    }
+}
+
+void Lockstep::load(size_t lane)
+{
+    const CPU& cpu = lanes[lane].cpu;
+    r8[REG_A][lane] = cpu.regs.a;
+    r8[REG_F][lane] = cpu.regs.f;
+    r8[REG_B][lane] = cpu.regs.b;
+    r8[REG_C][lane] = cpu.regs.c;
+    r8[REG_D][lane] = cpu.regs.d;
+    r8[REG_E][lane] = cpu.regs.e;
+    r8[REG_H][lane] = cpu.regs.h;
+    r8[REG_L][lane] = cpu.regs.l;
+    sp[lane] = cpu.sp;
+    pc[lane] = cpu.pc;
+}
+
+void Lockstep::store(size_t lane)
+{
+    CPU& cpu = lanes[lane].cpu;
+    cpu.regs.a = r8[REG_A][lane];
+    cpu.regs.f = r8[REG_F][lane];
+    cpu.regs.b = r8[REG_B][lane];
+    cpu.regs.c = r8[REG_C][lane];
+    cpu.regs.d = r8[REG_D][lane];
+    cpu.regs.e = r8[REG_E][lane];
+    cpu.regs.h = r8[REG_H][lane];
+    cpu.regs.l = r8[REG_L][lane];
+    cpu.sp = sp[lane];
+    cpu.pc = pc[lane];
+}
+
+void Lockstep::scalar_step(size_t lane)
+{
+    store(lane);
+    lanes[lane].step();
+    load(lane);
+    stats.scalar_instructions++;
+}
+
+bool Lockstep::frame_done(size_t lane) const
+{
+    const Gameboy& gb = lanes[lane];
+    return gb.ppu.frame_count != frame[lane] || gb.scheduler.now >= deadline[lane];
+}
+
+// Runs one instruction for the lanes in `mask`, all of them at the same PC. `operands` are the bytes that follow the
+// opcode in ROM. Sets the cycles of each lane
+bool Lockstep::execute_vector(uint8_t opcode, const uint8_t* operands)
+{
+    VectorOpInfo info = vector_ops[opcode];
+    size_t n = lanes.size();
+    const uint8_t* m = mask.data();
+    uint8_t* a = r8[REG_A].data();
+    uint8_t* f = r8[REG_F].data();
+    uint8_t dst = (opcode >> 3) & 7;
+    uint8_t src = opcode & 7;
+    uint8_t imm8 = operands[0];
+    uint16_t imm16 = operands[0] | (operands[1] << 8);
+
+    std::fill(cycles.begin(), cycles.end(), info.cycles);
+    for (size_t i = 0; i < n; ++i)
+    {
+        pc[i] += m[i] & info.length;
+    }
+
+    // BC, DE, HL as register pairs, SP on its own
+    size_t rr = (opcode >> 4) & 3;
+    auto pair = [&](auto&& fn) {
+        if (rr == 3)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                sp[i] = select16(m[i], fn(sp[i]), sp[i]);
+            }
+            return;
+        }
+        uint8_t* hi = r8[rr * 2].data();
+        uint8_t* lo = r8[rr * 2 + 1].data();
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint16_t value = fn(uint16_t(hi[i] << 8 | lo[i]));
+            hi[i] = select(m[i], value >> 8, hi[i]);
+            lo[i] = select(m[i], uint8_t(value), lo[i]);
+        }
+    };
+
+    // NZ, Z, NC, C from bits 3 and 4, unconditional forms set `always`
+    auto taken = [&](uint8_t fl, bool always) {
+        uint8_t cond = (opcode >> 3) & 3;
+        bool set = fl & (cond < 2 ? FLAG_Z : FLAG_C);
+        return always || set == bool(cond & 1);
+    };
+
+    switch (info.op)
+    {
+    case VectorOp::NOP:
+        break;
+    case VectorOp::LD_R_R:
+    {
+        uint8_t* d = r8[dst].data();
+        const uint8_t* s = r8[src].data();
+        for (size_t i = 0; i < n; ++i)
+        {
+            d[i] = select(m[i], s[i], d[i]);
+        }
+        break;
+    }
+    case VectorOp::LD_R_D8:
+    {
+        uint8_t* d = r8[dst].data();
+        for (size_t i = 0; i < n; ++i)
+        {
+            d[i] = select(m[i], imm8, d[i]);
+        }
+        break;
+    }
+    case VectorOp::INC_R:
+    case VectorOp::DEC_R:
+    {
+        bool inc = info.op == VectorOp::INC_R;
+        uint8_t* d = r8[dst].data();
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t x = d[i];
+            uint8_t res = inc ? x + 1 : x - 1;
+            bool half = inc ? (x & 0x0f) == 0x0f : (x & 0x0f) == 0;
+            uint8_t fl = (f[i] & (FLAG_C | 0x0f)) | (res == 0 ? FLAG_Z : 0) | (inc ? 0 : FLAG_N) | (half ? FLAG_H : 0);
+            d[i] = select(m[i], res, x);
+            f[i] = select(m[i], fl, f[i]);
+        }
+        break;
+    }
+    case VectorOp::LD_RR_D16:
+        pair([&](uint16_t) { return imm16; });
+        break;
+    case VectorOp::INC_RR:
+        pair([](uint16_t v) { return uint16_t(v + 1); });
+        break;
+    case VectorOp::DEC_RR:
+        pair([](uint16_t v) { return uint16_t(v - 1); });
+        break;
+    case VectorOp::ALU_R:
+    {
+        const uint8_t* s = r8[src].data();
+        alu_op(dst, n, m, a, f, [&](size_t i) { return uint16_t(s[i]); });
+        break;
+    }
+    case VectorOp::ALU_D8:
+        alu_op(dst, n, m, a, f, [&](size_t) { return uint16_t(imm8); });
+        break;
+    case VectorOp::JR:
+    {
+        int8_t offset = bit_cast<int8_t>(imm8);
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t jump = m[i] & (taken(f[i], opcode == 0x18) ? 0xff : 0);
+            pc[i] = select16(jump, pc[i] + offset, pc[i]);
+            cycles[i] += jump & 1;
+        }
+        break;
+    }
+    case VectorOp::JP:
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t jump = m[i] & (taken(f[i], opcode == 0xc3) ? 0xff : 0);
+            pc[i] = select16(jump, imm16, pc[i]);
+            cycles[i] += jump & 1;
+        }
+        break;
+    case VectorOp::RLCA:
+    case VectorOp::RRCA:
+    case VectorOp::RLA:
+    case VectorOp::RRA:
+    {
+        bool left = info.op == VectorOp::RLCA || info.op == VectorOp::RLA;
+        bool through_carry = info.op == VectorOp::RLA || info.op == VectorOp::RRA;
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t x = a[i];
+            uint8_t out = left ? x >> 7 : x & 1;
+            uint8_t in = through_carry ? (f[i] >> 4) & 1 : out;
+            uint8_t res = left ? (x << 1) | in : (x >> 1) | (in << 7);
+            a[i] = select(m[i], res, x);
+            f[i] = select(m[i], (f[i] & 0x0f) | (out << 4), f[i]);
+        }
+        break;
+    }
+    case VectorOp::CPL:
+        for (size_t i = 0; i < n; ++i)
+        {
+            a[i] ^= m[i];
+            f[i] |= m[i] & (FLAG_N | FLAG_H);
+        }
+        break;
+    case VectorOp::SCF:
+    case VectorOp::CCF:
+    {
+        bool complement = info.op == VectorOp::CCF;
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint8_t fl = f[i] & ~(FLAG_N | FLAG_H);
+            fl = complement ? fl ^ FLAG_C : fl | FLAG_C;
+            f[i] = select(m[i], fl, f[i]);
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+    return true;
+}
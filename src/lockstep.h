@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+
+#include "gameboy.h"
+
+struct LockstepStats
+{
+    uint64_t vector_steps = 0;
+    uint64_t vector_instructions = 0;
+    uint64_t scalar_instructions = 0;
+    uint64_t demoted_frames = 0;
+
+    // Average number of lanes executing each vector step
+    double occupancy() const
+    {
+        return vector_steps > 0 ? double(vector_instructions) / vector_steps : 0;
+    }
+};
+
+// Experimental. Runs instances of the same ROM together, one lane per instance. The CPU registers of all lanes are
+// kept as arrays, and every step executes the instruction at the lowest PC for the lanes that are at that PC, the
+// others being masked until they reach it again. Register only instructions fetched from ROM (loads, ALU, INC/DEC,
+// jumps) are executed for all the lanes at once with branch free loops that the compiler turns into SIMD, the other
+// instructions, and every lane that is halted or blocked by OAM DMA, go through the scalar interpreter. A lane that
+// stays masked for MAX_DIVERGENCE steps finishes its frame in the scalar interpreter. Lanes end up in exactly the
+// state run_frame() would give them
+struct Lockstep
+{
+    static constexpr uint32_t MAX_DIVERGENCE = 1024;
+
+    // The lanes must run the same ROM, instances are copied
+    void add(const Gameboy& gb);
+    void run_frame();
+
+    size_t size() const
+    {
+        return lanes.size();
+    }
+
+    std::vector<Gameboy> lanes;
+    LockstepStats stats;
+
+private:
+    void load(size_t lane);
+    void store(size_t lane);
+    void scalar_step(size_t lane);
+    bool execute_vector(uint8_t opcode, const uint8_t* operands);
+    bool frame_done(size_t lane) const;
+
+    // Registers indexed by their 3 bit encoding, F takes the place of (HL)
+    std::vector<uint8_t> r8[8];
+    std::vector<uint16_t> sp;
+    std::vector<uint16_t> pc;
+    std::vector<uint8_t> cycles;
+    std::vector<uint8_t> mask;
+
+    // Lanes at the PC of the step, and lanes that have not finished their frame
+    std::vector<uint8_t> group;
+    std::vector<uint8_t> running;
+    std::vector<uint32_t> divergence;
+    std::vector<uint64_t> frame;
+    std::vector<uint64_t> deadline;
+};
@@ -7,6 +7,7 @@
 
 #include "gameboy.h"
 #include "interrupt.h"
+#include "rewind.h"
 
 struct InstrInfo
 {
@@ -16,11 +17,16 @@ struct InstrInfo
     bool valid = false;
 };
 
-bag::Image placeholder;
+Gameboy gb;
+bag::Image screen;
 std::vector<InstrInfo> instr_info;
 bool scroll_to_pc = true;
+bool rewinding = false;
 inline static constexpr uint32_t scale = 5;
 
+std::shared_ptr<SerialLog> serial_log = std::make_shared<SerialLog>();
+Rewind history;
+
 bag::Image debug_tiles;
 uint32_t debug_tiles_data[384 * 8 * 8] = {};
 
@@ -43,14 +49,17 @@ void load_instruction(Gameboy& gb, size_t addr)
 void load_disassembly()
 {
     instr_info.resize(Memory::VRAM_BEGIN);
-    Gameboy g = gb;
-    load_instruction(g, 0x100);
-    load_instruction(g, 0x101);
-    g.cpu.pc = 0x150;
-    for (size_t i = g.cpu.pc; i < Memory::VRAM_BEGIN; i = g.cpu.pc)
+    // Decoding only reads the memory and moves the PC, the instance is used in place and its PC put back
+    uint16_t pc = gb.cpu.pc;
+    gb.cpu.pc = 0x100;
+    load_instruction(gb, 0x100);
+    load_instruction(gb, 0x101);
+    gb.cpu.pc = 0x150;
+    for (size_t i = gb.cpu.pc; i < Memory::VRAM_BEGIN; i = gb.cpu.pc)
     {
-        load_instruction(g, i);
+        load_instruction(gb, i);
     }
+    gb.cpu.pc = pc;
 }
 
 void game_window()
@@ -71,7 +80,8 @@ void game_window()
         return;
     }
 
-    ImGui::Image(placeholder.to_ptr(), ImGui::GetWindowSize());
+    screen.update(gb.ppu.renderer.output.data);
+    ImGui::Image(screen.to_ptr(), ImGui::GetWindowSize());
 
     ImGui::PopStyleVar(2);
     ImGui::End();
@@ -80,11 +90,12 @@ void game_window()
 void memory_window()
 {
     static auto mem_line = [&](size_t i) {
+        // The ROM is only readable
+        const Memory& mem = gb.memory;
         ImGui::Text("0x%04zx:  %02x %02x %02x %02x %02x %02x %02x %02x  %02x %02x %02x %02x %02x %02x %02x %02x", i,
-                    gb.memory[i + 0], gb.memory[i + 1], gb.memory[i + 2], gb.memory[i + 3], gb.memory[i + 4],
-                    gb.memory[i + 5], gb.memory[i + 6], gb.memory[i + 7], gb.memory[i + 8], gb.memory[i + 9],
-                    gb.memory[i + 10], gb.memory[i + 11], gb.memory[i + 12], gb.memory[i + 13], gb.memory[i + 14],
-                    gb.memory[i + 15]);
+                    mem[i + 0], mem[i + 1], mem[i + 2], mem[i + 3], mem[i + 4], mem[i + 5], mem[i + 6], mem[i + 7],
+                    mem[i + 8], mem[i + 9], mem[i + 10], mem[i + 11], mem[i + 12], mem[i + 13], mem[i + 14],
+                    mem[i + 15]);
     };
 
     static auto mem_text = [&](uint16_t begin, uint16_t end) {
@@ -201,7 +212,7 @@ void state_window()
     for (size_t i = 0; i < static_cast<size_t>(Interrupt::Count); ++i)
     {
         Interrupt interrupt = static_cast<Interrupt>(i);
-        bool enable = interrupt_enable(interrupt);
+        bool enable = gb.interrupts.enabled(interrupt);
         char label[32];
         sprintf(label, "##%s", interrupt_str[interrupt]);
         ImGui::TextUnformatted(interrupt_str[interrupt]);
@@ -213,8 +224,8 @@ void state_window()
 
     // Timer
 
-    ImGui::Text("DIV 0x%02x   TIMA 0x%02x", gb.memory[0xff04], gb.memory[0xff05]);
-    ImGui::Text("TMA 0x%02x   TAC 0x%02x", gb.memory[0xff06], gb.memory[0xff07]);
+    ImGui::Text("DIV 0x%02x   TIMA 0x%02x", gb.memory.read(Timer::DIV), gb.memory.read(Timer::TIMA));
+    ImGui::Text("TMA 0x%02x   TAC 0x%02x", gb.memory.read(Timer::TMA), gb.memory.read(Timer::TAC));
 
     ImGui::End();
 }
@@ -244,19 +255,24 @@ void control_window()
         scroll_to_pc = true;
     }
     ImGui::SameLine();
+    // Rewinds while held
+    ImGui::Button("Rewind");
+    rewinding = ImGui::IsItemActive();
+    ImGui::SameLine();
     if (ImGui::Button("Goto pc"))
     {
         scroll_to_pc = true;
     }
 
     ImGui::Text("cycles   %llu", gb.cpu.cycles);
+    ImGui::Text("rewind   %zu frames, %.1f MB", history.frames(), history.memory_used() / (1024.0 * 1024.0));
     if (gb.cpu.pc < instr_info.size())
     {
         ImGui::Text("%s", instr_info[gb.cpu.pc].text.c_str());
     }
     else
     {
-        ImGui::Text("0x%02x", gb.memory[gb.cpu.pc]);
+        ImGui::Text("0x%02x", gb.memory.read(gb.cpu.pc));
     }
 
     ImGui::End();
@@ -321,10 +337,18 @@ void serial_window()
 
     if (ImGui::Button("Clear"))
     {
-        gb.serial_data.clear();
+        serial_log->clear();
     }
     ImGui::BeginChild("SerialDataText");
-    ImGui::TextWrapped("%s", gb.serial_data.c_str());
+    ImGuiListClipper clipper;
+    clipper.Begin(serial_log->lines.size());
+    while (clipper.Step())
+    {
+        for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i)
+        {
+            ImGui::TextUnformatted(serial_log->lines[i].c_str());
+        }
+    }
     ImGui::EndChild();
 
     ImGui::End();
@@ -354,7 +378,7 @@ void tiles_window()
             for (size_t b = 0; b < 8; ++b)
             {
                 uint8_t color_index = (bit(line_hi, b) << 1) | bit(line_lo, b);
-                uint32_t color = PPU::colors[color_index];
+                uint32_t color = LCD::colors[color_index];
                 debug_tiles_data[tile_y * 16 * 8 * 8 + i * 16 * 8 + tile_x * 8 + 7 - b] = color;
             }
         }
@@ -392,6 +416,20 @@ void update()
     size_t n_instructions = 100000;
     auto begin = std::chrono::high_resolution_clock::now();
 
+    if (rewinding)
+    {
+        // The restored frame is drawn from its end state, running it again would replay its serial output and audio.
+        // Each update goes one recorded frame further back
+        if (history.step_back(gb))
+        {
+            gb.ppu.redraw();
+            scroll_to_pc = true;
+        }
+        render();
+        return;
+    }
+
+    uint64_t frame = gb.ppu.frame_count;
     while (!gb.stepping)
     {
         if (gb.cpu.pc < instr_info.size() && instr_info[gb.cpu.pc].breakpoint)
@@ -412,7 +450,13 @@ void update()
         }
         gb.step();
         n_instructions--;
+        if (gb.ppu.frame_count != frame)
+        {
+            frame = gb.ppu.frame_count;
+            history.push(gb);
+        }
     }
+    gb.serial.drain();
 
     render();
 }
@@ -420,9 +464,10 @@ void update()
 int main(int argc, char** argv)
 {
     bag::init(bag::Options{160 * scale, 144 * scale, "badge"}, false);
-    placeholder.from_file("../gameboy.jpg");
+    screen.from_buffer(gb.ppu.renderer.output.data, LCD::WIDTH, LCD::HEIGHT);
     debug_tiles.from_buffer((uint8_t*)debug_tiles_data, 16 * 8, 24 * 8);
     ASSERT(argc > 1);
+    gb.serial.add_sink(serial_log);
     gb.load_rom(argv[1]);
     load_disassembly();
 
@@ -1,85 +1,211 @@
 #include "memory.h"
 
+#include <array>
 #include <cstring>
 
 #include "gameboy.h"
-#include "timer.h"
-
-void Memory::reset(const CartInfo&)
-{
-    memset(data + VRAM_BEGIN, 0, SIZE - VRAM_BEGIN);
-    data[0xFF00] = 0xCF;
-    data[0xFF01] = 0x00;
-    data[0xFF02] = 0x7E;
-    data[0xFF04] = 0xAB;
-    data[0xFF05] = 0x00;
-    data[0xFF06] = 0x00;
-    data[0xFF07] = 0xF8;
-    data[0xFF0F] = 0xE1;
-    data[0xFF10] = 0x80;
-    data[0xFF11] = 0xBF;
-    data[0xFF12] = 0xF3;
-    data[0xFF13] = 0xFF;
-    data[0xFF14] = 0xBF;
-    data[0xFF16] = 0x3F;
-    data[0xFF17] = 0x00;
-    data[0xFF18] = 0xFF;
-    data[0xFF19] = 0xBF;
-    data[0xFF1A] = 0x7F;
-    data[0xFF1B] = 0xFF;
-    data[0xFF1C] = 0x9F;
-    data[0xFF1D] = 0xFF;
-    data[0xFF1E] = 0xBF;
-    data[0xFF20] = 0xFF;
-    data[0xFF21] = 0x00;
-    data[0xFF22] = 0x00;
-    data[0xFF23] = 0xBF;
-    data[0xFF24] = 0x77;
-    data[0xFF25] = 0xF3;
-    data[0xFF26] = 0xF1;
-    data[0xFF40] = 0x91;
-    data[0xFF41] = 0x85;
-    data[0xFF42] = 0x00;
-    data[0xFF43] = 0x00;
-    data[0xFF44] = 0x00;
-    data[0xFF45] = 0x00;
-    data[0xFF46] = 0xFF;
-    data[0xFF47] = 0xFC;
-    data[0xFF48] = 0x00;
-    data[0xFF49] = 0x00;
-    data[0xFF4A] = 0x00;
-    data[0xFF4B] = 0x00;
-    data[0xFF4D] = 0xFF;
-    data[0xFF4F] = 0xFF;
-    data[0xFF51] = 0xFF;
-    data[0xFF52] = 0xFF;
-    data[0xFF53] = 0xFF;
-    data[0xFF54] = 0xFF;
-    data[0xFF55] = 0xFF;
-    data[0xFF56] = 0xFF;
-    data[0xFF68] = 0xFF;
-    data[0xFF69] = 0xFF;
-    data[0xFF6A] = 0xFF;
-    data[0xFF6B] = 0xFF;
-    data[0xFF70] = 0xFF;
-    data[0xFFFF] = 0x00;
+
+static constexpr auto open_bus = [] {
+    std::array<uint8_t, Memory::PAGE_SIZE> page = {};
+    page.fill(0xff);
+    return page;
+}();
+
+// Read in place of a missing ROM, as the ROM area was before one is loaded
+static const Rom empty_rom;
+
+Memory::Memory()
+{
+    map_pages();
+}
+
+void Memory::reset(const CartInfo& cart_info)
+{
+    auto reg = [this](uint16_t addr) -> uint8_t& { return ram[addr - RAM_BEGIN]; };
+
+    cgb = cart_info.cgb != 0;
+    bus_blocked = false;
+    memset(ram, 0, sizeof(ram));
+    memset(vram_bank1, 0, sizeof(vram_bank1));
+    memset(palette_ram, 0xff, sizeof(palette_ram));
+    reg(0xFF00) = 0xCF;
+    reg(0xFF01) = 0x00;
+    reg(0xFF02) = 0x7E;
+    reg(0xFF04) = 0xAB;
+    reg(0xFF05) = 0x00;
+    reg(0xFF06) = 0x00;
+    reg(0xFF07) = 0xF8;
+    reg(0xFF0F) = 0xE1;
+    reg(0xFF40) = 0x91;
+    reg(0xFF41) = 0x85;
+    reg(0xFF42) = 0x00;
+    reg(0xFF43) = 0x00;
+    reg(0xFF44) = 0x00;
+    reg(0xFF45) = 0x00;
+    reg(0xFF46) = 0xFF;
+    reg(0xFF47) = 0xFC;
+    reg(0xFF48) = 0x00;
+    reg(0xFF49) = 0x00;
+    reg(0xFF4A) = 0x00;
+    reg(0xFF4B) = 0x00;
+    reg(0xFF4D) = 0xFF;
+    reg(0xFF4F) = cgb ? 0x00 : 0xFF;
+    reg(0xFF51) = 0xFF;
+    reg(0xFF52) = 0xFF;
+    reg(0xFF53) = 0xFF;
+    reg(0xFF54) = 0xFF;
+    reg(0xFF55) = 0xFF;
+    reg(0xFF56) = 0xFF;
+    reg(0xFF68) = cgb ? 0x00 : 0xFF;
+    reg(0xFF69) = cgb ? 0x00 : 0xFF;
+    reg(0xFF6A) = cgb ? 0x00 : 0xFF;
+    reg(0xFF6B) = cgb ? 0x00 : 0xFF;
+    reg(0xFF70) = 0xFF;
+    reg(0xFFFF) = 0x00;
+    map_pages();
+}
+
+void Memory::map_pages()
+{
+    for (size_t page = 0; page < ROM_SIZE / PAGE_SIZE; ++page)
+    {
+        mapped_pages[page] = (rom ? rom.get() : &empty_rom)->data + page * PAGE_SIZE;
+    }
+    for (size_t page = RAM_BEGIN / PAGE_SIZE; page < PAGE_COUNT; ++page)
+    {
+        mapped_pages[page] = ram + (page * PAGE_SIZE - RAM_BEGIN);
+    }
+    map_vram();
+    set_bus_blocked(bus_blocked);
+}
+
+void Memory::map_vram()
+{
+    const uint8_t* vram = cgb && bit(ram[LCD::VBK - RAM_BEGIN], 0) ? vram_bank1 : ram + (VRAM_BEGIN - RAM_BEGIN);
+    for (size_t i = 0; i < VRAM_SIZE / PAGE_SIZE; ++i)
+    {
+        size_t page = VRAM_BEGIN / PAGE_SIZE + i;
+        mapped_pages[page] = vram + i * PAGE_SIZE;
+        read_pages[page] = bus_blocked ? open_bus.data() : mapped_pages[page];
+    }
+}
+
+void Memory::set_bus_blocked(bool blocked)
+{
+    bus_blocked = blocked;
+    for (size_t page = 0; page < IO_REG_BEGIN / PAGE_SIZE; ++page)
+    {
+        read_pages[page] = blocked ? open_bus.data() : mapped_pages[page];
+    }
+    read_pages[IO_REG_BEGIN / PAGE_SIZE] = mapped_pages[IO_REG_BEGIN / PAGE_SIZE];
+}
+
+void Memory::mark_dirty(uint16_t addr, size_t size)
+{
+    ASSERT(addr >= RAM_BEGIN);
+    bool bank1 = cgb && bit(ram[LCD::VBK - RAM_BEGIN], 0);
+    for (size_t page = addr / PAGE_SIZE; page <= (addr + size - 1) / PAGE_SIZE; ++page)
+    {
+        size_t state = page - RAM_BEGIN / PAGE_SIZE;
+        if (bank1 && page <= VRAM_END / PAGE_SIZE)
+        {
+            state += VRAM_BANK1_PAGE;
+        }
+        dirty_pages[state / 64] |= 1ull << (state % 64);
+    }
+    if (addr == LCD::BCPD || addr == LCD::OCPD)
+    {
+        dirty_pages[PALETTE_PAGE / 64] |= 1ull << (PALETTE_PAGE % 64);
+    }
+}
+
+void Memory::mark_all_dirty()
+{
+    memset(dirty_pages, 0xff, sizeof(dirty_pages));
+}
+
+void Memory::clear_dirty()
+{
+    memset(dirty_pages, 0, sizeof(dirty_pages));
+}
+
+std::span<uint8_t> Memory::state_page(size_t page)
+{
+    if (page < VRAM_BANK1_PAGE)
+    {
+        return {ram + page * PAGE_SIZE, PAGE_SIZE};
+    }
+    if (page < PALETTE_PAGE)
+    {
+        return {vram_bank1 + (page - VRAM_BANK1_PAGE) * PAGE_SIZE, PAGE_SIZE};
+    }
+    return {palette_ram, sizeof(palette_ram)};
 }
 
 uint8_t Memory::operator[](size_t i) const
 {
     ASSERT(i < SIZE);
-    return data[i];
+    if (i < RAM_BEGIN)
+    {
+        return (rom ? rom.get() : &empty_rom)->data[i];
+    }
+    return ram[i - RAM_BEGIN];
 }
 
 uint8_t& Memory::operator[](size_t i)
 {
-    ASSERT(i < SIZE);
-    return data[i];
+    ASSERT(i >= RAM_BEGIN && i < SIZE);
+    return ram[i - RAM_BEGIN];
 }
 
 uint8_t Memory::read(uint16_t addr) const
 {
-    return data[addr];
+    if ((addr & 0xff80) == IO_REG_BEGIN)
+    {
+        return read_io(addr);
+    }
+    return read_pages[addr >> 8][addr & 0xff];
+}
+
+uint8_t Memory::read_io(uint16_t addr) const
+{
+    Gameboy& gb = *owner;
+    switch (addr)
+    {
+    case LCD::STAT:
+    case LCD::LY:
+        return gb.ppu.read(gb, addr);
+    case Serial::SB:
+    case Serial::SC:
+        return gb.serial.read(gb, addr);
+    case Interrupts::IF:
+        return gb.interrupts.read(addr);
+    case Timer::DIV:
+    case Timer::TIMA:
+    case Timer::TMA:
+    case Timer::TAC:
+        return gb.timer.read(gb, addr);
+    case HDMA::HDMA1:
+    case HDMA::HDMA2:
+    case HDMA::HDMA3:
+    case HDMA::HDMA4:
+    case HDMA::HDMA5:
+        return cgb ? gb.hdma.read(addr) : 0xff;
+    case LCD::VBK:
+        return cgb ? 0xfe | (ram[addr - RAM_BEGIN] & 1) : 0xff;
+    case LCD::BCPS:
+    case LCD::OCPS:
+        return cgb ? 0x40 | ram[addr - RAM_BEGIN] : 0xff;
+    case LCD::BCPD:
+    case LCD::OCPD:
+        return cgb ? palette_ram[(addr == LCD::OCPD) * 64 + (ram[addr - 1 - RAM_BEGIN] & 0x3f)] : 0xff;
+    default:
+        if (addr >= APU::NR10 && addr <= APU::WAVE_END)
+        {
+            return gb.apu.read(gb, addr);
+        }
+        return ram[addr - RAM_BEGIN];
+    }
 }
 
 uint16_t Memory::read16(uint16_t addr) const
@@ -91,22 +217,56 @@ uint16_t Memory::read16(uint16_t addr) const
 
 void Memory::write(uint16_t addr, uint8_t value)
 {
-    if (addr <= ROM_BANK_N_END)
+    // During OAM DMA the CPU only reaches the IO registers and HRAM
+    if (addr <= ROM_BANK_N_END || (bus_blocked && addr < IO_REG_BEGIN))
     {
         return;
     }
 
-    if (addr == 0xff04)
+    Gameboy& gb = *owner;
+    mark_dirty(addr);
+    if (addr >= Timer::DIV && addr <= Timer::TAC)
+    {
+        gb.timer.write(gb, addr, value);
+        return;
+    }
+    else if (addr == Serial::SB || addr == Serial::SC)
+    {
+        gb.serial.write(gb, addr, value);
+        return;
+    }
+    else if (addr == Interrupts::IF)
+    {
+        gb.interrupts.write(addr, value);
+        return;
+    }
+    else if (addr == Interrupts::IE)
+    {
+        // Also stored in memory so that reads go through the HRAM page
+        gb.interrupts.write(addr, value);
+    }
+    else if (addr == DMA::DMA_REG)
+    {
+        gb.dma.start(gb, value);
+    }
+    else if (addr >= APU::NR10 && addr <= APU::WAVE_END)
     {
-        timer_reset_div();
+        gb.apu.write(gb, addr, value);
         return;
     }
-    else if (addr == 0xff46)
+    else if (cgb && addr >= HDMA::HDMA1 && addr <= HDMA::HDMA5)
     {
-        gb.dma.start(value);
+        gb.hdma.write(gb, addr, value);
+        return;
+    }
+    else if (addr <= VRAM_END || (addr >= OAM_BEGIN && addr <= OAM_END) || (addr >= LCD::LCDC && addr <= LCD::WX)
+             || addr == LCD::VBK || (addr >= LCD::BCPS && addr <= LCD::OCPD))
+    {
+        gb.ppu.write(gb, addr, value);
+        return;
     }
 
-    data[addr] = value;
+    ram[addr - RAM_BEGIN] = value;
 }
 
 void Memory::write16(uint16_t addr, uint16_t value)
@@ -1,12 +1,22 @@
 #pragma once
 
+#include <memory>
+#include <span>
+
 #include "common.h"
 
 struct CartInfo;
+struct Gameboy;
+
+struct Rom
+{
+    uint8_t data[0x8000] = {};
+};
 
 struct Memory
 {
     static constexpr size_t SIZE = 0x10000;
+    static constexpr size_t ROM_SIZE = sizeof(Rom::data);
 
     static constexpr uint16_t ROM_BANK_0_BEGIN = 0x0000;
     static constexpr uint16_t ROM_BANK_0_END = 0x3fff;
@@ -16,6 +26,7 @@ struct Memory
 
     static constexpr uint16_t VRAM_BEGIN = 0x8000;
     static constexpr uint16_t VRAM_END = 0x9fff;
+    static constexpr size_t VRAM_SIZE = VRAM_END - VRAM_BEGIN + 1;
 
     static constexpr uint16_t EXTERN_RAM_BEGIN = 0xa000;
     static constexpr uint16_t EXTERN_RAM_END = 0xbfff;
@@ -43,13 +54,63 @@ struct Memory
 
     static constexpr uint16_t IE = 0xffff;
 
-    uint8_t data[SIZE] = {};
+    static constexpr size_t PAGE_SIZE = 0x100;
+    static constexpr size_t PAGE_COUNT = SIZE / PAGE_SIZE;
+
+    // Everything above the ROM, from VRAM bank 0 to IE
+    static constexpr uint16_t RAM_BEGIN = VRAM_BEGIN;
+    static constexpr size_t RAM_SIZE = SIZE - RAM_BEGIN;
+
+    // Pages of the whole memory state: the RAM, VRAM bank 1 and the CGB palettes
+    static constexpr size_t VRAM_BANK1_PAGE = RAM_SIZE / PAGE_SIZE;
+    static constexpr size_t PALETTE_PAGE = VRAM_BANK1_PAGE + VRAM_SIZE / PAGE_SIZE;
+    static constexpr size_t STATE_PAGES = PALETTE_PAGE + 1;
+
+    // Ordered by how often a CPU access touches them: the first cache line holds what every write checks, the read
+    // page table follows, then the RAM
+
+    // Instance the IO registers are dispatched to, set on reset
+    Gameboy* owner = nullptr;
+    bool cgb = false;
+    bool bus_blocked = false;
+    // State pages written since the last snapshot. Writes through operator[] are not tracked
+    uint64_t dirty_pages[(STATE_PAGES + 63) / 64] = {};
+
+    // Pages seen by CPU reads outside of the IO registers. mapped_pages follow the selected banks, read_pages are the
+    // same unless OAM DMA blocks the bus, then every page below the IO registers reads 0xff
+    const uint8_t* read_pages[PAGE_COUNT] = {};
+
+    // ram holds the address space above the ROM with VRAM bank 0, the banked memory lives beside it
+    alignas(64) uint8_t ram[RAM_SIZE] = {};
+    uint8_t vram_bank1[VRAM_SIZE] = {};
+    uint8_t palette_ram[0x80] = {};
+
+    const uint8_t* mapped_pages[PAGE_COUNT] = {};
+
+    // The ROM is never written, copies and clones of an instance share it. Without a ROM the area reads 0
+    std::shared_ptr<const Rom> rom;
+
+    Memory();
 
     void reset(const CartInfo& cart_info);
+    void map_pages();
+    void map_vram();
+    void set_bus_blocked(bool blocked);
+    void mark_dirty(uint16_t addr, size_t size = 1);
+    void mark_all_dirty();
+    void clear_dirty();
+    std::span<uint8_t> state_page(size_t page);
+
+    inline bool is_dirty(size_t page) const
+    {
+        return dirty_pages[page / 64] & (1ull << (page % 64));
+    }
 
     uint8_t operator[](size_t i) const;
+    // Only reaches the RAM
     uint8_t& operator[](size_t i);
     uint8_t read(uint16_t addr) const;
+    uint8_t read_io(uint16_t addr) const;
     uint16_t read16(uint16_t addr) const;
     void write(uint16_t addr, uint8_t value);
     void write16(uint16_t addr, uint16_t value);
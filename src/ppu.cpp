@@ -1,9 +1,522 @@
 #include "ppu.h"
 
 #include "gameboy.h"
+#include "interrupt.h"
+#include "render_thread.h"
 
 void PPU::reset(Gameboy& gb)
 {
-    OAM_table = (OAMEntry*)&gb.memory[Memory::OAM_BEGIN];
-    vram = &gb.memory[Memory::VRAM_BEGIN];
+    bool threaded = render_thread != nullptr;
+    render_thread = nullptr;
+
+    frame_start = gb.scheduler.now;
+    current_frame = 0;
+    frame_count = 0;
+    rendered_lines = 0;
+    fixed_line = UINT64_MAX;
+    frame_rendered = false;
+    attach(gb);
+    renderer.reset();
+    begin_frame();
+
+    if (bit(gb.memory[LCD::LCDC], 7))
+    {
+        schedule_next(gb, gb.scheduler.now);
+    }
+    if (threaded)
+    {
+        start_render_thread();
+    }
+}
+
+// The machine state was replaced by a savestate, the renderer caches and the render thread copy are rebuilt from it
+void PPU::restore(Gameboy& gb)
+{
+    bool threaded = render_thread != nullptr;
+    render_thread = nullptr;
+
+    // A full reset clears the frame, it is only needed to switch between DMG and CGB colours
+    bool mode_changed = renderer.mem.cgb != gb.memory.cgb;
+    attach(gb);
+    if (mode_changed)
+    {
+        uint8_t window_line = renderer.window_line;
+        renderer.reset();
+        renderer.window_line = window_line;
+    }
+    renderer.dirty_palettes = 0xffff;
+    renderer.invalidate_lines();
+
+    if (threaded)
+    {
+        start_render_thread();
+    }
+}
+
+// Points the PPU and the renderer at the memory of `gb`
+void PPU::attach(Gameboy& gb)
+{
+    Memory& mem = gb.memory;
+    OAM_table = (OAMEntry*)&mem[Memory::OAM_BEGIN];
+    vram = &mem[Memory::VRAM_BEGIN];
+    renderer.attach({{vram, mem.vram_bank1}, (uint8_t*)OAM_table, &mem[Memory::IO_REG_BEGIN], mem.palette_ram, mem.cgb});
+}
+
+uint8_t PPU::read(const Gameboy& gb, uint16_t addr) const
+{
+    const Memory& mem = gb.memory;
+    uint8_t ly = 0;
+    uint8_t mode = 0;
+    if (bit(mem[LCD::LCDC], 7))
+    {
+        uint64_t line = (gb.scheduler.now - frame_start) / DOTS_PER_LINE;
+        uint32_t line_dot = (gb.scheduler.now - frame_start) % DOTS_PER_LINE;
+        ly = line % LINES_PER_FRAME;
+        if (ly >= LCD::HEIGHT)
+        {
+            mode = 1;
+        }
+        else if (line_dot < OAM_SCAN_DOTS)
+        {
+            mode = 2;
+        }
+        else if (gb.scheduler.now < hblank_at(gb, line))
+        {
+            mode = 3;
+        }
+    }
+
+    if (addr == LCD::LY)
+    {
+        return ly;
+    }
+    return 0x80 | (mem[LCD::STAT] & 0x78) | ((ly == mem[LCD::LYC]) << 2) | mode;
+}
+
+// OAM and the LCDC sprite bits set the number of sprites fetched in mode 3, SCX the pixels discarded at its start
+static bool changes_mode3(uint16_t addr)
+{
+    return addr == LCD::LCDC || addr == LCD::SCX || (addr >= Memory::OAM_BEGIN && addr <= Memory::OAM_END);
+}
+
+// The LCD::STAT sources are ORed into one line and the interrupt is raised on its rising edge, a source going high
+// while another one already holds the line raises nothing. Level of the line at the start of a line, then at its end
+static bool stat_high_at_start(uint8_t stat, uint8_t lyc, uint32_t ly)
+{
+    return (ly >= LCD::HEIGHT ? bit(stat, 4) : bit(stat, 5)) || (ly == lyc && bit(stat, 6));
+}
+
+static bool stat_high_at_end(uint8_t stat, uint8_t lyc, uint32_t ly)
+{
+    return (ly >= LCD::HEIGHT ? bit(stat, 4) : bit(stat, 3)) || (ly == lyc && bit(stat, 6));
+}
+
+// `line` is counted from frame_start, the first line after the LCD is turned on has no previous one
+static bool stat_rises_at_line(uint8_t stat, uint8_t lyc, uint64_t line)
+{
+    uint32_t ly = line % PPU::LINES_PER_FRAME;
+    uint32_t prev = (ly + PPU::LINES_PER_FRAME - 1) % PPU::LINES_PER_FRAME;
+    return stat_high_at_start(stat, lyc, ly) && (line == 0 || !stat_high_at_end(stat, lyc, prev));
+}
+
+// Mode 2 ends before HBlank, only a matching LYC can still hold the line
+static bool stat_rises_at_hblank(uint8_t stat, uint8_t lyc, uint32_t ly)
+{
+    return bit(stat, 3) && !(ly == lyc && bit(stat, 6));
+}
+
+void PPU::write(Gameboy& gb, uint16_t addr, uint8_t value)
+{
+    catch_up(gb);
+
+    bool was_on = bit(gb.memory[LCD::LCDC], 7);
+    bool started = was_on && changes_mode3(addr) && fix_hblank(gb);
+
+    switch (addr)
+    {
+    case LCD::LCDC:
+    {
+        if (!was_on && bit(value, 7))
+        {
+            frame_start = gb.scheduler.now;
+            current_frame = 0;
+            rendered_lines = 0;
+            fixed_line = UINT64_MAX;
+            begin_frame();
+            schedule_next(gb, gb.scheduler.now);
+            if (gb.hdma.active)
+            {
+                gb.hdma.schedule_next(gb, gb.scheduler.now);
+            }
+        }
+        else if (was_on && !bit(value, 7))
+        {
+            gb.scheduler.cancel(Event::PPU);
+        }
+        break;
+    }
+    case LCD::STAT:
+        value = (gb.memory[LCD::STAT] & 0x87) | (value & 0x78);
+        break;
+    case LCD::LY:
+        return;
+    default:
+        break;
+    }
+
+    if (render_thread)
+    {
+        store_video(renderer.mem, addr, value);
+        render_thread->record({addr, value, rendered_lines, JournalEntry::Kind::WRITE});
+    }
+    else
+    {
+        renderer.write(addr, value);
+    }
+
+    if (addr == LCD::VBK)
+    {
+        gb.memory.map_vram();
+    }
+
+    // Registers that move the next LCD::STAT interrupt, the length of mode 3 also moves the HBlank of HDMA
+    if (!was_on || !bit(gb.memory[LCD::LCDC], 7))
+    {
+        return;
+    }
+    if (changes_mode3(addr))
+    {
+        retime(gb, started);
+    }
+    else if (addr == LCD::STAT || addr == LCD::LYC)
+    {
+        schedule_next(gb, gb.scheduler.now);
+    }
+}
+
+void PPU::write_block(Gameboy& gb, uint16_t addr, const uint8_t* data, size_t size)
+{
+    catch_up(gb);
+    gb.memory.mark_dirty(addr, size);
+    bool lcd_on = bit(gb.memory[LCD::LCDC], 7);
+    bool oam = addr == Memory::OAM_BEGIN;
+    bool started = lcd_on && oam && fix_hblank(gb);
+
+    if (render_thread)
+    {
+        store_video_block(renderer.mem, addr, data, size);
+        render_thread->record_block(addr, data, size, rendered_lines);
+    }
+    else
+    {
+        renderer.write_block(addr, data, size);
+    }
+
+    if (lcd_on && oam)
+    {
+        retime(gb, started);
+    }
+}
+
+void PPU::on_event(Gameboy& gb, uint64_t when)
+{
+    const Memory& mem = gb.memory;
+    uint8_t stat = mem[LCD::STAT];
+    uint64_t elapsed = when - frame_start;
+    uint32_t ly = (elapsed / DOTS_PER_LINE) % LINES_PER_FRAME;
+
+    bool stat_interrupt = false;
+    if (elapsed % DOTS_PER_LINE == 0)
+    {
+        if (ly == LCD::HEIGHT)
+        {
+            catch_up(gb);
+            if (render_thread)
+            {
+                render_thread->present(renderer, frame_rendered);
+                render_thread->record({0, 0, rendered_lines, JournalEntry::Kind::END_FRAME});
+            }
+            else
+            {
+                if (rendering)
+                {
+                    renderer.end_frame();
+                }
+                frame_rendered = rendering;
+            }
+            frame_count += 1;
+            gb.interrupts.request(Interrupt::VBLANK);
+        }
+        stat_interrupt = stat_rises_at_line(stat, mem[LCD::LYC], elapsed / DOTS_PER_LINE);
+    }
+    else
+    {
+        stat_interrupt = stat_rises_at_hblank(stat, mem[LCD::LYC], ly);
+    }
+
+    if (stat_interrupt)
+    {
+        gb.interrupts.request(Interrupt::LCD_STAT);
+    }
+    schedule_next(gb, when);
+}
+
+bool PPU::set_output(PixelFormat format, uint32_t downsample, uint32_t crop_x, uint32_t crop_y, uint32_t crop_width,
+                     uint32_t crop_height)
+{
+    bool threaded = render_thread != nullptr;
+    stop_render_thread();
+    bool res = renderer.set_output(format, downsample, crop_x, crop_y, crop_width, crop_height);
+    if (threaded)
+    {
+        start_render_thread();
+    }
+    return res;
+}
+
+void PPU::set_color_correction(ColorCorrection correction)
+{
+    bool threaded = render_thread != nullptr;
+    stop_render_thread();
+    renderer.set_color_correction(correction);
+    if (threaded)
+    {
+        start_render_thread();
+    }
+}
+
+void PPU::start_render_thread()
+{
+    if (!render_thread)
+    {
+        render_thread = std::make_shared<RenderThread>(renderer, rendered_lines, rendering);
+    }
+}
+
+void PPU::stop_render_thread()
+{
+    if (render_thread)
+    {
+        render_thread->finish(renderer, rendered_lines);
+        render_thread = nullptr;
+    }
+}
+
+// With a render thread the renderer only follows it when a frame is presented, its window line counter is caught up
+// for savestates
+void PPU::sync_window_line()
+{
+    if (render_thread)
+    {
+        renderer.window_line = render_thread->window_line(rendered_lines);
+    }
+}
+
+// Draws a whole frame from the current video memory and registers without running the machine, to show a restored
+// state. Register writes made in the middle of the original frame are not reproduced
+void PPU::redraw()
+{
+    bool threaded = render_thread != nullptr;
+    stop_render_thread();
+
+    uint8_t window_line = renderer.window_line;
+    renderer.invalidate_lines();
+    renderer.begin_frame();
+    for (uint8_t ly = 0; ly < LCD::HEIGHT; ++ly)
+    {
+        renderer.render_line(ly);
+    }
+    renderer.end_frame();
+    renderer.window_line = window_line;
+    frame_rendered = true;
+
+    if (threaded)
+    {
+        start_render_thread();
+    }
+}
+
+void PPU::request_frame()
+{
+    render_requested = true;
+}
+
+void PPU::begin_frame()
+{
+    rendering = render_requested || (render_enabled && frame_count % (frame_skip + 1) == 0);
+    render_requested = false;
+
+    if (render_thread)
+    {
+        render_thread->record({0, rendering, 0, JournalEntry::Kind::BEGIN_FRAME});
+    }
+    else
+    {
+        renderer.begin_frame();
+    }
+}
+
+void PPU::catch_up(Gameboy& gb)
+{
+    if (!bit(gb.memory[LCD::LCDC], 7))
+    {
+        return;
+    }
+
+    uint64_t elapsed = gb.scheduler.now - frame_start;
+    uint64_t frame = elapsed / DOTS_PER_FRAME;
+    if (frame != current_frame)
+    {
+        current_frame = frame;
+        rendered_lines = 0;
+        begin_frame();
+    }
+
+    if (!rendering)
+    {
+        return;
+    }
+
+    uint64_t line = elapsed / DOTS_PER_LINE;
+    uint32_t ly = line % LINES_PER_FRAME;
+    uint32_t target = LCD::HEIGHT;
+    if (ly < LCD::HEIGHT)
+    {
+        target = ly + (gb.scheduler.now >= hblank_at(gb, line));
+    }
+
+    // The render thread renders the lines when it replays the next write
+    if (render_thread)
+    {
+        rendered_lines = target;
+    }
+    while (rendered_lines < target)
+    {
+        renderer.render_line(rendered_lines);
+        rendered_lines += 1;
+    }
+}
+
+uint32_t PPU::mode3_length(const Gameboy& gb, uint8_t ly) const
+{
+    const OAMEntry* sprites[LCD::MAX_SPRITES_PER_LINE] = {};
+    uint8_t lcdc = gb.memory[LCD::LCDC];
+    size_t n_sprites = bit(lcdc, 1) ? select_sprites(OAM_table, lcdc, ly, sprites) : 0;
+    return 172 + gb.memory[LCD::SCX] % 8 + n_sprites * 6;
+}
+
+void PPU::schedule_next(Gameboy& gb, uint64_t after)
+{
+    const Memory& mem = gb.memory;
+    uint8_t stat = mem[LCD::STAT];
+    uint8_t lyc = mem[LCD::LYC];
+    uint64_t line = (after - frame_start) / DOTS_PER_LINE;
+
+    // VBlank is always scheduled so that the frame is completed, so this finds an event within a frame. Events that
+    // raise no LCD::STAT interrupt are skipped
+    for (;; ++line)
+    {
+        uint64_t line_begin = frame_start + line * DOTS_PER_LINE;
+        uint32_t ly = line % LINES_PER_FRAME;
+        if (line_begin > after && (ly == LCD::HEIGHT || stat_rises_at_line(stat, lyc, line)))
+        {
+            gb.scheduler.schedule(Event::PPU, line_begin);
+            return;
+        }
+        if (ly < LCD::HEIGHT && stat_rises_at_hblank(stat, lyc, ly))
+        {
+            uint64_t hblank = hblank_at(gb, line);
+            if (hblank > after)
+            {
+                gb.scheduler.schedule(Event::PPU, hblank);
+                return;
+            }
+        }
+    }
+}
+
+// Start of the HBlank of a visible line counted from frame_start. Mode 3 lasts as long as the registers currently make
+// it, unless its end was fixed on that line
+uint64_t PPU::hblank_at(const Gameboy& gb, uint64_t line) const
+{
+    if (line == fixed_line)
+    {
+        return fixed_hblank;
+    }
+    return frame_start + line * DOTS_PER_LINE + OAM_SCAN_DOTS + mode3_length(gb, line % LINES_PER_FRAME);
+}
+
+// Called before a change of the mode 3 length. Once the HBlank of the current line started, its start is fixed so that
+// the change only applies to the next lines. Returns whether it started
+bool PPU::fix_hblank(const Gameboy& gb)
+{
+    uint64_t now = gb.scheduler.now;
+    uint64_t line = (now - frame_start) / DOTS_PER_LINE;
+    if (line % LINES_PER_FRAME >= LCD::HEIGHT)
+    {
+        return false;
+    }
+    uint64_t hblank = hblank_at(gb, line);
+    if (now < hblank)
+    {
+        return false;
+    }
+    fixed_line = line;
+    fixed_hblank = hblank;
+    return true;
+}
+
+// The length of mode 3 changed, moves the LCD::STAT and HDMA HBlank events. `started` is what fix_hblank returned
+// before the change, the events of the current line then already happened. Mode 3 cannot end in the past, if it became
+// shorter than the time already spent in it the HBlank starts now
+void PPU::retime(Gameboy& gb, bool started)
+{
+    uint64_t now = gb.scheduler.now;
+    uint64_t line = (now - frame_start) / DOTS_PER_LINE;
+    if (!started && line % LINES_PER_FRAME < LCD::HEIGHT && hblank_at(gb, line) <= now)
+    {
+        fixed_line = line;
+        fixed_hblank = now;
+        if (stat_rises_at_hblank(gb.memory[LCD::STAT], gb.memory[LCD::LYC], line % LINES_PER_FRAME))
+        {
+            gb.scheduler.schedule(Event::PPU, now);
+        }
+        else
+        {
+            schedule_next(gb, now);
+        }
+        if (gb.hdma.active)
+        {
+            gb.scheduler.schedule(Event::HDMA, now);
+        }
+        return;
+    }
+
+    schedule_next(gb, now);
+    if (gb.hdma.active)
+    {
+        gb.hdma.schedule_next(gb, started ? now + 1 : now);
+    }
+}
+
+uint64_t PPU::next_hblank(const Gameboy& gb, uint64_t after) const
+{
+    if (!bit(gb.memory[LCD::LCDC], 7))
+    {
+        return Scheduler::NEVER;
+    }
+
+    uint64_t line = (after - frame_start) / DOTS_PER_LINE;
+    for (;; ++line)
+    {
+        uint32_t ly = line % LINES_PER_FRAME;
+        if (ly < LCD::HEIGHT)
+        {
+            uint64_t hblank = hblank_at(gb, line);
+            if (hblank >= after)
+            {
+                return hblank;
+            }
+        }
+    }
 }
@@ -1,28 +1,67 @@
 #pragma once
 
+#include <memory>
+
 #include "common.h"
+#include "renderer.h"
 
 struct Gameboy;
-
-struct OAMEntry
-{
-    uint8_t y_pos;
-    uint8_t x_pos;
-    uint8_t tile_index;
-    uint8_t cgb_palette_number : 3;
-    uint8_t tile_vram_bank : 1;
-    uint8_t palette_number : 1;
-    uint8_t x_flip : 1;
-    uint8_t y_flip : 1;
-    uint8_t bg_prio : 1;
-};
+struct RenderThread;
 
 struct PPU
 {
-    constexpr static uint32_t colors[] = {0xffffffff, 0xffaaaaaa, 0xff555555, 0xff000000};
+    static constexpr uint32_t DOTS_PER_LINE = 456;
+    static constexpr uint32_t LINES_PER_FRAME = 154;
+    static constexpr uint32_t DOTS_PER_FRAME = DOTS_PER_LINE * LINES_PER_FRAME;
+    static constexpr uint32_t OAM_SCAN_DOTS = 80;
 
     void reset(Gameboy& gb);
+    void restore(Gameboy& gb);
+    void attach(Gameboy& gb);
+    uint8_t read(const Gameboy& gb, uint16_t addr) const;
+    void write(Gameboy& gb, uint16_t addr, uint8_t value);
+    void write_block(Gameboy& gb, uint16_t addr, const uint8_t* data, size_t size);
+    void on_event(Gameboy& gb, uint64_t when);
+
+    bool set_output(PixelFormat format, uint32_t downsample, uint32_t crop_x = 0, uint32_t crop_y = 0,
+                    uint32_t crop_width = LCD::WIDTH, uint32_t crop_height = LCD::HEIGHT);
+    void set_color_correction(ColorCorrection correction);
+    void start_render_thread();
+    void stop_render_thread();
+    void sync_window_line();
+    void request_frame();
+    void redraw();
+    void begin_frame();
+    void catch_up(Gameboy& gb);
+    uint32_t mode3_length(const Gameboy& gb, uint8_t ly) const;
+    uint64_t next_hblank(const Gameboy& gb, uint64_t after) const;
+    void schedule_next(Gameboy& gb, uint64_t after);
+    uint64_t hblank_at(const Gameboy& gb, uint64_t line) const;
+    bool fix_hblank(const Gameboy& gb);
+    void retime(Gameboy& gb, bool started);
+
+    // Point into the memory of the instance, see attach
+    OAMEntry* OAM_table = nullptr;
+    uint8_t* vram = nullptr;
+
+    // LY, STAT mode and coincidence are derived from the time elapsed since the first frame began
+    uint64_t frame_start = 0;
+    uint64_t current_frame = 0;
+    uint64_t frame_count = 0;
+    uint8_t rendered_lines = 0;
+
+    // Line, counted from frame_start, whose HBlank start no longer follows the registers of mode 3, see fix_hblank
+    uint64_t fixed_line = UINT64_MAX;
+    uint64_t fixed_hblank = 0;
+
+    // Frames that are not rendered keep their timing, interrupts and memory access rules
+    bool render_enabled = true;
+    uint32_t frame_skip = 0;
+    bool render_requested = false;
+    bool rendering = true;
+    bool frame_rendered = false;
 
-    OAMEntry* OAM_table;
-    uint8_t* vram;
+    // Renders inline, or holds the frames presented by the render thread when there is one
+    Renderer renderer;
+    std::shared_ptr<RenderThread> render_thread;
 };
@@ -0,0 +1,197 @@
+#include "render_thread.h"
+
+#include <cstring>
+
+RenderThread::RenderThread(const Renderer& front, uint8_t _lines_done, bool _rendering)
+    : completed_data(front.output.data, front.output.data + front.output.size())
+    , completed_rendered(false)
+    , renderer(front)
+    , lines_done(_lines_done)
+    , rendering(_rendering)
+{
+    memcpy(vram[0], front.mem.vram[0], sizeof(vram[0]));
+    memcpy(vram[1], front.mem.vram[1], sizeof(vram[1]));
+    memcpy(oam, front.mem.oam, sizeof(oam));
+    memcpy(io, front.mem.io, sizeof(io));
+    memcpy(palette_ram, front.mem.palette_ram, sizeof(palette_ram));
+    renderer.attach({{vram[0], vram[1]}, oam, io, palette_ram, front.mem.cgb});
+    journal.entries.reserve(MAX_BATCH_SIZE);
+    thread = std::thread(&RenderThread::run, this);
+}
+
+RenderThread::~RenderThread()
+{
+    {
+        std::lock_guard lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+void RenderThread::record(const JournalEntry& entry)
+{
+    journal.entries.push_back(entry);
+    if (entry.kind == JournalEntry::Kind::END_FRAME)
+    {
+        frames_recorded += 1;
+        flush();
+    }
+    else if (journal.entries.size() >= MAX_BATCH_SIZE)
+    {
+        flush();
+    }
+}
+
+void RenderThread::record_block(uint16_t addr, const uint8_t* data, size_t size, uint8_t line)
+{
+    uint32_t offset = journal.data.size();
+    journal.data.insert(journal.data.end(), data, data + size);
+    record({addr, 0, line, JournalEntry::Kind::BLOCK, static_cast<uint16_t>(size), offset});
+}
+
+void RenderThread::flush()
+{
+    if (journal.entries.empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard lock(mutex);
+        batches.push_back(std::move(journal));
+    }
+    cv.notify_all();
+    journal = {};
+    journal.entries.reserve(MAX_BATCH_SIZE);
+}
+
+void RenderThread::present(Renderer& front, bool& frame_rendered)
+{
+    // Waits for every frame recorded so far, the frame being recorded is not ended yet
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return frames_done >= frames_recorded; });
+    memcpy(front.output.data, completed_data.data(), completed_data.size());
+    memcpy(front.changed_lines, completed_changed_lines, sizeof(completed_changed_lines));
+    frame_rendered = completed_rendered;
+}
+
+void RenderThread::finish(Renderer& front, uint8_t target_lines)
+{
+    flush();
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] { return batches.empty() && !busy; });
+        quit = true;
+    }
+    cv.notify_all();
+    thread.join();
+
+    // Lines are only rendered when a journaled write needs them, catch up with the emulation thread
+    while (rendering && lines_done < target_lines)
+    {
+        renderer.render_line(lines_done);
+        lines_done += 1;
+    }
+
+    VideoMemory front_mem = front.mem;
+    front = renderer;
+    front.attach(front_mem);
+}
+
+// Savestates need the window line counter of the lines the emulation thread already passed, the render thread is
+// idle while they are rendered here
+uint8_t RenderThread::window_line(uint8_t target_lines)
+{
+    flush();
+    std::unique_lock lock(mutex);
+    cv.wait(lock, [&] { return batches.empty() && !busy; });
+    while (rendering && lines_done < target_lines)
+    {
+        renderer.render_line(lines_done);
+        lines_done += 1;
+    }
+    return renderer.window_line;
+}
+
+void RenderThread::run()
+{
+    for (;;)
+    {
+        JournalBatch batch;
+        {
+            std::unique_lock lock(mutex);
+            busy = false;
+            cv.notify_all();
+            cv.wait(lock, [&] { return !batches.empty() || quit; });
+            if (batches.empty())
+            {
+                return;
+            }
+            batch = std::move(batches.front());
+            batches.pop_front();
+            busy = true;
+        }
+
+        for (const JournalEntry& entry : batch.entries)
+        {
+            replay(entry, batch.data);
+        }
+    }
+}
+
+void RenderThread::replay(const JournalEntry& entry, const std::vector<uint8_t>& data)
+{
+    switch (entry.kind)
+    {
+    case JournalEntry::Kind::WRITE:
+    case JournalEntry::Kind::BLOCK:
+    {
+        while (rendering && lines_done < entry.line)
+        {
+            renderer.render_line(lines_done);
+            lines_done += 1;
+        }
+
+        if (entry.kind == JournalEntry::Kind::BLOCK)
+        {
+            renderer.write_block(entry.addr, data.data() + entry.offset, entry.size);
+        }
+        else
+        {
+            renderer.write(entry.addr, entry.value);
+        }
+        break;
+    }
+    case JournalEntry::Kind::BEGIN_FRAME:
+        rendering = entry.value;
+        lines_done = 0;
+        renderer.begin_frame();
+        break;
+    case JournalEntry::Kind::END_FRAME:
+    {
+        if (rendering)
+        {
+            while (lines_done < LCD::HEIGHT)
+            {
+                renderer.render_line(lines_done);
+                lines_done += 1;
+            }
+            renderer.end_frame();
+        }
+
+        std::lock_guard lock(mutex);
+        if (rendering)
+        {
+            memcpy(completed_data.data(), renderer.output.data, completed_data.size());
+            memcpy(completed_changed_lines, renderer.changed_lines, sizeof(completed_changed_lines));
+        }
+        completed_rendered = rendering;
+        frames_done += 1;
+        cv.notify_all();
+        break;
+    }
+    }
+}
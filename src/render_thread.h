@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "memory.h"
+#include "renderer.h"
+
+struct JournalEntry
+{
+    enum class Kind : uint8_t
+    {
+        WRITE,
+        BLOCK,
+        BEGIN_FRAME,
+        END_FRAME
+    };
+
+    uint16_t addr = 0;
+    uint8_t value = 0;
+    uint8_t line = 0;
+    Kind kind = Kind::WRITE;
+
+    // Bytes of a BLOCK write in the batch data
+    uint16_t size = 0;
+    uint32_t offset = 0;
+};
+
+struct JournalBatch
+{
+    std::vector<JournalEntry> entries;
+    std::vector<uint8_t> data;
+};
+
+// Renders frames away from the emulation thread. The emulation thread journals the writes to VRAM, OAM, LCD
+// registers and CGB palettes tagged with the number of lines rendered before them, the render thread replays them on
+// its own copy of that memory. Frames are presented one frame behind and are identical to the ones rendered inline.
+struct RenderThread
+{
+    static constexpr size_t MAX_BATCH_SIZE = 4096;
+
+    RenderThread(const Renderer& front, uint8_t lines_done, bool rendering);
+    ~RenderThread();
+
+    void record(const JournalEntry& entry);
+    void record_block(uint16_t addr, const uint8_t* data, size_t size, uint8_t line);
+    void flush();
+    void present(Renderer& front, bool& frame_rendered);
+    void finish(Renderer& front, uint8_t lines_done);
+    uint8_t window_line(uint8_t target_lines);
+
+private:
+    void run();
+    void replay(const JournalEntry& entry, const std::vector<uint8_t>& data);
+
+    // Emulation thread
+    JournalBatch journal;
+    uint64_t frames_recorded = 0;
+
+    // Shared
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<JournalBatch> batches;
+    uint64_t frames_done = 0;
+    bool busy = false;
+    bool quit = false;
+    std::vector<uint8_t> completed_data;
+    uint64_t completed_changed_lines[(LCD::HEIGHT + 63) / 64] = {};
+    bool completed_rendered = false;
+
+    // Render thread
+    Renderer renderer;
+    uint8_t vram[2][Memory::VRAM_SIZE] = {};
+    uint8_t oam[Memory::OAM_END - Memory::OAM_BEGIN + 1] = {};
+    uint8_t io[Memory::IO_REG_END - Memory::IO_REG_BEGIN + 1] = {};
+    uint8_t palette_ram[LCD::PALETTE_RAM_SIZE] = {};
+    uint8_t lines_done = 0;
+    bool rendering = false;
+
+    std::thread thread;
+};
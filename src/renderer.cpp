@@ -0,0 +1,576 @@
+#include "renderer.h"
+
+#include <array>
+#include <cstring>
+#include <algorithm>
+
+#include "memory.h"
+
+static constexpr size_t STRIP_TILES = 21;
+static constexpr size_t STRIP_WORDS = 4;
+
+// Strips hold the colour and palette planes of a line followed by the CGB BG-to-OBJ priority
+static constexpr size_t STRIP_PLANES = 6;
+static constexpr size_t STRIP_PRIO = 5;
+
+// Tile rows store the leftmost pixel in the most significant bit, bitplanes store it in the least significant one
+static constexpr auto reversed_bytes = [] {
+    std::array<uint8_t, 256> table = {};
+    for (size_t i = 0; i < 256; ++i)
+    {
+        for (size_t b = 0; b < 8; ++b)
+        {
+            if (i & (1 << b))
+            {
+                table[i] |= 0x80 >> b;
+            }
+        }
+    }
+    return table;
+}();
+
+// Returns the bits [pos, pos + 64) of the strip, bits outside of the strip are 0
+static uint64_t extract_word(const uint64_t (&strip)[STRIP_WORDS], int pos)
+{
+    int word = pos >= 0 ? pos / 64 : (pos - 63) / 64;
+    int offset = pos - word * 64;
+    auto get = [&](int i) -> uint64_t { return i >= 0 && i < static_cast<int>(STRIP_WORDS) ? strip[i] : 0; };
+    uint64_t res = get(word) >> offset;
+    if (offset != 0)
+    {
+        res |= get(word + 1) << (64 - offset);
+    }
+    return res;
+}
+
+static Bitplane range_mask(int begin, int end)
+{
+    Bitplane mask;
+    for (size_t w = 0; w < Bitplane::WORDS; ++w)
+    {
+        int lo = std::clamp(begin - static_cast<int>(w * 64), 0, 64);
+        int hi = std::clamp(end - static_cast<int>(w * 64), 0, 64);
+        uint64_t below_hi = hi == 64 ? ~0ull : (1ull << hi) - 1;
+        uint64_t below_lo = lo == 64 ? ~0ull : (1ull << lo) - 1;
+        mask.words[w] = below_hi & ~below_lo;
+    }
+    return mask;
+}
+
+static void place_byte(Bitplane& plane, uint8_t bits, int x)
+{
+    if (x < 0)
+    {
+        bits >>= -x;
+        x = 0;
+    }
+    size_t word = x / 64;
+    size_t offset = x % 64;
+    if (word >= Bitplane::WORDS)
+    {
+        return;
+    }
+    plane.words[word] |= static_cast<uint64_t>(bits) << offset;
+    if (offset > 56 && word + 1 < Bitplane::WORDS)
+    {
+        plane.words[word + 1] |= static_cast<uint64_t>(bits) >> (64 - offset);
+    }
+}
+
+// Maps 2 bits colour indices to shades for every pixel at once
+template <typename T>
+static void apply_palette(T lo, T hi, uint8_t palette, T& out_lo, T& out_hi)
+{
+    const T masks[4] = {static_cast<T>(~(lo | hi)), static_cast<T>(lo & ~hi), static_cast<T>(~lo & hi),
+                        static_cast<T>(lo & hi)};
+    out_lo = 0;
+    out_hi = 0;
+    for (size_t c = 0; c < 4; ++c)
+    {
+        out_lo |= bit(palette, c * 2) ? masks[c] : 0;
+        out_hi |= bit(palette, c * 2 + 1) ? masks[c] : 0;
+    }
+}
+
+static void fetch_tiles(const VideoMemory& mem, uint8_t lcdc, uint16_t map, uint8_t y, uint8_t first_tile,
+                        uint64_t (&strip)[STRIP_PLANES][STRIP_WORDS])
+{
+    uint16_t row = (map - Memory::VRAM_BEGIN) + (y / 8) * 32;
+    for (size_t i = 0; i < STRIP_TILES; ++i)
+    {
+        // CGB attributes are in bank 1 at the same offset as the tile index
+        uint16_t offset = row + ((first_tile + i) & 31);
+        uint8_t index = mem.vram[0][offset];
+        uint8_t attr = mem.cgb ? mem.vram[1][offset] : 0;
+        uint16_t tile = bit(lcdc, 4) ? index * 16 : 0x1000 + static_cast<int8_t>(index) * 16;
+        uint8_t tile_row = bit(attr, 6) ? 7 - y % 8 : y % 8;
+        const uint8_t* data = mem.vram[bit(attr, 3)] + tile + tile_row * 2;
+
+        size_t shift = (i % 8) * 8;
+        uint8_t lo = bit(attr, 5) ? data[0] : reversed_bytes[data[0]];
+        uint8_t hi = bit(attr, 5) ? data[1] : reversed_bytes[data[1]];
+        strip[0][i / 8] |= static_cast<uint64_t>(lo) << shift;
+        strip[1][i / 8] |= static_cast<uint64_t>(hi) << shift;
+        for (size_t b = 0; b < 3; ++b)
+        {
+            strip[2 + b][i / 8] |= bit(attr, b) ? 0xffull << shift : 0;
+        }
+        strip[STRIP_PRIO][i / 8] |= bit(attr, 7) ? 0xffull << shift : 0;
+    }
+}
+
+void store_video(const VideoMemory& mem, uint16_t addr, uint8_t value)
+{
+    if (addr <= Memory::VRAM_END)
+    {
+        mem.vram[vram_bank(mem)][addr - Memory::VRAM_BEGIN] = value;
+    }
+    else if (addr <= Memory::OAM_END)
+    {
+        mem.oam[addr - Memory::OAM_BEGIN] = value;
+    }
+    else if (mem.cgb && (addr == LCD::BCPD || addr == LCD::OCPD))
+    {
+        mem.palette_ram[palette_index(mem, addr)] = value;
+        uint8_t& spec = mem.io[(addr - 1) & 0x7f];
+        if (bit(spec, 7))
+        {
+            spec = 0x80 | ((spec + 1) & 0x3f);
+        }
+    }
+    else
+    {
+        mem.io[addr & 0x7f] = value;
+    }
+}
+
+void store_video_block(const VideoMemory& mem, uint16_t addr, const uint8_t* data, size_t size)
+{
+    if (addr <= Memory::VRAM_END)
+    {
+        ASSERT(addr + size <= Memory::VRAM_END + 1);
+        memcpy(mem.vram[vram_bank(mem)] + (addr - Memory::VRAM_BEGIN), data, size);
+    }
+    else
+    {
+        ASSERT(addr >= Memory::OAM_BEGIN && addr + size <= Memory::OAM_END + 1);
+        memcpy(mem.oam + (addr - Memory::OAM_BEGIN), data, size);
+    }
+}
+
+size_t select_sprites(const OAMEntry* oam, uint8_t lcdc, uint8_t ly, const OAMEntry** sprites)
+{
+    int height = bit(lcdc, 2) ? 16 : 8;
+    size_t n_sprites = 0;
+    for (size_t i = 0; i < 40 && n_sprites < LCD::MAX_SPRITES_PER_LINE; ++i)
+    {
+        int row = ly + 16 - oam[i].y_pos;
+        if (row >= 0 && row < height)
+        {
+            sprites[n_sprites++] = &oam[i];
+        }
+    }
+    return n_sprites;
+}
+
+void Renderer::attach(const VideoMemory& _mem)
+{
+    mem = _mem;
+    oam = (const OAMEntry*)mem.oam;
+}
+
+void Renderer::reset()
+{
+    window_line = 0;
+    output.color = mem.cgb;
+    dirty_palettes = 0xffff;
+    palette_stamp = 0;
+    if (mem.cgb)
+    {
+        refresh_palettes();
+    }
+    else
+    {
+        for (size_t i = 0; i < FrameOutput::COLORS; ++i)
+        {
+            output.set_color(i, LCD::colors[i % 4]);
+        }
+    }
+    vram_clock = 0;
+    tile_data_stamp = 0;
+    memset(tile_stamps, 0, sizeof(tile_stamps));
+    memset(map_stamps, 0, sizeof(map_stamps));
+    memset(changed_lines, 0, sizeof(changed_lines));
+    memset(pending_changed_lines, 0, sizeof(pending_changed_lines));
+    invalidate_lines();
+    output.clear();
+}
+
+void Renderer::set_color_correction(ColorCorrection correction)
+{
+    color_correction = correction;
+    dirty_palettes = 0xffff;
+    palette_stamp += 1;
+}
+
+bool Renderer::set_output(PixelFormat format, uint32_t downsample, uint32_t crop_x, uint32_t crop_y,
+                          uint32_t crop_width, uint32_t crop_height)
+{
+    if (!output.configure(format, downsample, crop_x, crop_y, crop_width, crop_height))
+    {
+        return false;
+    }
+    invalidate_lines();
+    return true;
+}
+
+void Renderer::invalidate_lines()
+{
+    for (auto& line : lines)
+    {
+        line.valid = false;
+    }
+}
+
+bool Renderer::line_changed(uint8_t ly) const
+{
+    return changed_lines[ly / 64] & (1ull << (ly % 64));
+}
+
+void Renderer::begin_frame()
+{
+    window_line = 0;
+}
+
+void Renderer::end_frame()
+{
+    memcpy(changed_lines, pending_changed_lines, sizeof(changed_lines));
+    memset(pending_changed_lines, 0, sizeof(pending_changed_lines));
+}
+
+void Renderer::render_line(uint8_t ly)
+{
+    uint8_t lcdc = reg(LCD::LCDC);
+
+    const OAMEntry* sprites[LCD::MAX_SPRITES_PER_LINE] = {};
+    size_t n_sprites = bit(lcdc, 1) ? select_sprites(oam, lcdc, ly, sprites) : 0;
+    bool window = (mem.cgb || bit(lcdc, 0)) && bit(lcdc, 5) && ly >= reg(LCD::WY) && reg(LCD::WX) < LCD::WIDTH + 7;
+
+    if (mem.cgb && dirty_palettes)
+    {
+        refresh_palettes();
+    }
+
+    // CGB lines hold colour indices, a palette change recolours them without composing them again
+    LineCache& line = lines[ly];
+    uint64_t fingerprint = line_fingerprint(ly, window, sprites, n_sprites);
+    bool changed = mem.cgb && line.palette_stamp != palette_stamp;
+    line.palette_stamp = palette_stamp;
+    if (!line.valid || line.fingerprint != fingerprint || tiles_written(ly, window, sprites, n_sprites, line.stamp))
+    {
+        Bitplane planes[FrameOutput::PLANES];
+        compose_line(ly, window, sprites, n_sprites, planes);
+
+        changed |= !line.valid || memcmp(planes, line.planes, sizeof(planes)) != 0;
+        memcpy(line.planes, planes, sizeof(planes));
+        line.fingerprint = fingerprint;
+        line.stamp = vram_clock;
+        line.valid = true;
+    }
+    if (changed)
+    {
+        pending_changed_lines[ly / 64] |= 1ull << (ly % 64);
+    }
+
+    window_line += window;
+    output.write_line(ly, line.planes, changed);
+}
+
+void Renderer::refresh_palettes()
+{
+    const uint32_t* table = rgb555_table(color_correction);
+    for (size_t p = 0; p < 16; ++p)
+    {
+        if (!bit(dirty_palettes, p))
+        {
+            continue;
+        }
+        for (size_t c = 0; c < 4; ++c)
+        {
+            const uint8_t* entry = mem.palette_ram + p * 8 + c * 2;
+            output.set_color(p * 4 + c, table[(entry[0] | (entry[1] << 8)) & 0x7fff]);
+        }
+    }
+    dirty_palettes = 0;
+}
+
+uint64_t Renderer::line_fingerprint(uint8_t ly, bool window, const OAMEntry** sprites, size_t n_sprites) const
+{
+    uint8_t lcdc = reg(LCD::LCDC);
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&](uint64_t value) { hash = (hash ^ value) * 0x100000001b3ull; };
+
+    mix(lcdc | (reg(LCD::SCY) << 8) | (reg(LCD::SCX) << 16) | (static_cast<uint64_t>(reg(LCD::BGP)) << 24)
+        | (static_cast<uint64_t>(reg(LCD::OBP0)) << 32) | (static_cast<uint64_t>(reg(LCD::OBP1)) << 40)
+        | (static_cast<uint64_t>(reg(LCD::WY)) << 48) | (static_cast<uint64_t>(reg(LCD::WX)) << 56));
+    mix(map_stamps[bit(lcdc, 3)][static_cast<uint8_t>(reg(LCD::SCY) + ly) / 8]);
+    if (window)
+    {
+        mix(window_line);
+        mix(map_stamps[bit(lcdc, 6)][window_line / 8]);
+    }
+    for (size_t i = 0; i < n_sprites; ++i)
+    {
+        uint32_t entry = 0;
+        memcpy(&entry, sprites[i], sizeof(OAMEntry));
+        mix(entry);
+    }
+    return hash;
+}
+
+bool Renderer::tiles_written(uint8_t ly, bool window, const OAMEntry** sprites, size_t n_sprites,
+                             uint64_t since) const
+{
+    if (tile_data_stamp <= since)
+    {
+        return false;
+    }
+
+    uint8_t lcdc = reg(LCD::LCDC);
+    auto map_tile = [&](uint8_t index) -> size_t {
+        return bit(lcdc, 4) ? index : 256 + static_cast<int8_t>(index);
+    };
+
+    if (mem.cgb || bit(lcdc, 0))
+    {
+        const uint8_t* row = mem.vram[0] + ((bit(lcdc, 3) ? 0x9c00 : 0x9800) - Memory::VRAM_BEGIN)
+            + static_cast<uint8_t>(reg(LCD::SCY) + ly) / 8 * 32;
+        for (size_t i = 0; i < STRIP_TILES; ++i)
+        {
+            if (tile_stamps[map_tile(row[(reg(LCD::SCX) / 8 + i) & 31])] > since)
+            {
+                return true;
+            }
+        }
+    }
+    if (window)
+    {
+        const uint8_t* row =
+            mem.vram[0] + ((bit(lcdc, 6) ? 0x9c00 : 0x9800) - Memory::VRAM_BEGIN) + window_line / 8 * 32;
+        for (size_t i = 0; i < STRIP_TILES; ++i)
+        {
+            if (tile_stamps[map_tile(row[i])] > since)
+            {
+                return true;
+            }
+        }
+    }
+    for (size_t i = 0; i < n_sprites; ++i)
+    {
+        uint8_t tile = sprites[i]->tile_index;
+        if (tile_stamps[tile] > since || (bit(lcdc, 2) && tile_stamps[tile ^ 1] > since))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Renderer::write(uint16_t addr, uint8_t value)
+{
+    if (mem.cgb && (addr == LCD::BCPD || addr == LCD::OCPD))
+    {
+        size_t index = palette_index(mem, addr);
+        if (mem.palette_ram[index] != value)
+        {
+            dirty_palettes |= 1 << (index / 8);
+            palette_stamp += 1;
+        }
+    }
+    else if (addr <= Memory::VRAM_END)
+    {
+        uint16_t offset = addr - Memory::VRAM_BEGIN;
+        if (mem.vram[vram_bank(mem)][offset] != value)
+        {
+            stamp_vram(offset);
+        }
+    }
+    store_video(mem, addr, value);
+}
+
+void Renderer::write_block(uint16_t addr, const uint8_t* data, size_t size)
+{
+    // Stamps the 16 bytes granules that change, which are tiles or halves of map rows
+    if (addr <= Memory::VRAM_END)
+    {
+        const uint8_t* vram = mem.vram[vram_bank(mem)];
+        for (size_t i = 0; i < size;)
+        {
+            uint16_t offset = addr - Memory::VRAM_BEGIN + i;
+            size_t n = std::min<size_t>(16 - offset % 16, size - i);
+            if (memcmp(vram + offset, data + i, n) != 0)
+            {
+                stamp_vram(offset);
+            }
+            i += n;
+        }
+    }
+    store_video_block(mem, addr, data, size);
+}
+
+void Renderer::stamp_vram(uint16_t offset)
+{
+    vram_clock += 1;
+    if (offset < LCD::TILE_DATA_SIZE)
+    {
+        tile_stamps[offset / 16] = vram_clock;
+        tile_data_stamp = vram_clock;
+    }
+    else
+    {
+        map_stamps[(offset - LCD::TILE_DATA_SIZE) / 0x400][(offset % 0x400) / 32] = vram_clock;
+    }
+}
+
+void Renderer::compose_line(uint8_t ly, bool window, const OAMEntry** sprites, size_t n_sprites,
+                            Bitplane* planes) const
+{
+    uint8_t lcdc = reg(LCD::LCDC);
+
+    // DMG lines hold shades in the colour planes. CGB lines hold colour indices with their palette and layer, the
+    // background is always drawn and LCDC bit 0 only decides if it can be drawn over sprites
+    bool cgb = mem.cgb;
+    size_t n_planes = cgb ? FrameOutput::PLANES : 2;
+
+    // Background and window, opaque holds colour indices 1-3 and prio the CGB BG-to-OBJ priority attribute
+
+    Scanline bg;
+    if (cgb || bit(lcdc, 0))
+    {
+        uint64_t strip[STRIP_PLANES][STRIP_WORDS] = {};
+        uint8_t scx = reg(LCD::SCX);
+        uint16_t bg_map = bit(lcdc, 3) ? 0x9c00 : 0x9800;
+        fetch_tiles(mem, lcdc, bg_map, reg(LCD::SCY) + ly, scx / 8, strip);
+
+        Bitplane* bg_planes[STRIP_PLANES] = {&bg.planes[0], &bg.planes[1], &bg.planes[2],
+                                             &bg.planes[3], &bg.planes[4], &bg.prio};
+        for (size_t p = 0; p < STRIP_PLANES; ++p)
+        {
+            for (size_t w = 0; w < Bitplane::WORDS; ++w)
+            {
+                bg_planes[p]->words[w] = extract_word(strip[p], w * 64 + scx % 8);
+            }
+        }
+
+        if (window)
+        {
+            uint64_t win_strip[STRIP_PLANES][STRIP_WORDS] = {};
+            uint16_t win_map = bit(lcdc, 6) ? 0x9c00 : 0x9800;
+            fetch_tiles(mem, lcdc, win_map, window_line, 0, win_strip);
+
+            int wx = reg(LCD::WX) - 7;
+            Bitplane mask = range_mask(std::max(wx, 0), LCD::WIDTH);
+            for (size_t p = 0; p < STRIP_PLANES; ++p)
+            {
+                for (size_t w = 0; w < Bitplane::WORDS; ++w)
+                {
+                    uint64_t m = mask.words[w];
+                    uint64_t& word = bg_planes[p]->words[w];
+                    word = (word & ~m) | (extract_word(win_strip[p], w * 64 - wx) & m);
+                }
+            }
+        }
+
+        for (size_t w = 0; w < Bitplane::WORDS; ++w)
+        {
+            uint64_t& lo = bg.planes[0].words[w];
+            uint64_t& hi = bg.planes[1].words[w];
+            bg.opaque.words[w] = lo | hi;
+            if (!cgb)
+            {
+                apply_palette(lo, hi, reg(LCD::BGP), lo, hi);
+            }
+        }
+    }
+
+    // Sprites, opaque holds the pixels covered by a sprite and prio the BG over OBJ flag
+
+    Scanline obj;
+    if (n_sprites > 0)
+    {
+        uint8_t height = bit(lcdc, 2) ? 16 : 8;
+
+        // On DMG lower x has priority and OAM order breaks ties, on CGB only OAM order matters
+        if (!cgb)
+        {
+            std::stable_sort(sprites, sprites + n_sprites,
+                             [](const OAMEntry* a, const OAMEntry* b) { return a->x_pos < b->x_pos; });
+        }
+
+        // Sprites past the right edge still count towards the limit of the line
+        const Bitplane screen = range_mask(0, LCD::WIDTH);
+        for (size_t i = 0; i < n_sprites; ++i)
+        {
+            const OAMEntry& sprite = *sprites[i];
+            int x = sprite.x_pos - 8;
+            if (x >= static_cast<int>(LCD::WIDTH))
+            {
+                continue;
+            }
+            uint8_t row = ly + 16 - sprite.y_pos;
+            if (sprite.y_flip)
+            {
+                row = height - 1 - row;
+            }
+            uint8_t tile = height == 16 ? sprite.tile_index & 0xfe : sprite.tile_index;
+            const uint8_t* data = mem.vram[cgb ? sprite.tile_vram_bank : 0] + tile * 16 + row * 2;
+
+            uint8_t lo = sprite.x_flip ? data[0] : reversed_bytes[data[0]];
+            uint8_t hi = sprite.x_flip ? data[1] : reversed_bytes[data[1]];
+            uint8_t opaque = lo | hi;
+            if (!cgb)
+            {
+                apply_palette(lo, hi, reg(sprite.palette_number ? LCD::OBP1 : LCD::OBP0), lo, hi);
+            }
+
+            Scanline s;
+            place_byte(s.planes[0], lo, x);
+            place_byte(s.planes[1], hi, x);
+            place_byte(s.opaque, opaque, x);
+            for (size_t b = 0; cgb && b < 3; ++b)
+            {
+                place_byte(s.planes[2 + b], bit(sprite.cgb_palette_number, b) ? opaque : 0, x);
+            }
+
+            for (size_t w = 0; w < Bitplane::WORDS; ++w)
+            {
+                uint64_t uncovered = s.opaque.words[w] & screen.words[w] & ~obj.opaque.words[w];
+                for (size_t p = 0; p < n_planes; ++p)
+                {
+                    obj.planes[p].words[w] |= s.planes[p].words[w] & uncovered;
+                }
+                obj.prio.words[w] |= sprite.bg_prio ? uncovered : 0;
+                obj.opaque.words[w] |= uncovered;
+            }
+        }
+
+        if (cgb)
+        {
+            obj.planes[FrameOutput::PLANES - 1] = obj.opaque;
+        }
+    }
+
+    // Composition
+
+    bool bg_priority = !cgb || bit(lcdc, 0);
+    for (size_t w = 0; w < Bitplane::WORDS; ++w)
+    {
+        uint64_t bg_over = bg_priority ? (obj.prio.words[w] | bg.prio.words[w]) & bg.opaque.words[w] : 0;
+        uint64_t visible = obj.opaque.words[w] & ~bg_over;
+        for (size_t p = 0; p < FrameOutput::PLANES; ++p)
+        {
+            planes[p].words[w] = (bg.planes[p].words[w] & ~visible) | (obj.planes[p].words[w] & visible);
+        }
+    }
+}
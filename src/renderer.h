@@ -0,0 +1,156 @@
+#pragma once
+
+#include "common.h"
+#include "color.h"
+#include "frame_output.h"
+
+struct LCD
+{
+    static constexpr uint32_t WIDTH = 160;
+    static constexpr uint32_t HEIGHT = 144;
+    static constexpr uint32_t MAX_SPRITES_PER_LINE = 10;
+    static constexpr uint32_t TILE_DATA_SIZE = 0x1800;
+    static constexpr uint32_t PALETTE_RAM_SIZE = 0x80;
+
+    static constexpr uint16_t LCDC = 0xff40;
+    static constexpr uint16_t STAT = 0xff41;
+    static constexpr uint16_t SCY = 0xff42;
+    static constexpr uint16_t SCX = 0xff43;
+    static constexpr uint16_t LY = 0xff44;
+    static constexpr uint16_t LYC = 0xff45;
+    static constexpr uint16_t BGP = 0xff47;
+    static constexpr uint16_t OBP0 = 0xff48;
+    static constexpr uint16_t OBP1 = 0xff49;
+    static constexpr uint16_t WY = 0xff4a;
+    static constexpr uint16_t WX = 0xff4b;
+    static constexpr uint16_t VBK = 0xff4f;
+    static constexpr uint16_t BCPS = 0xff68;
+    static constexpr uint16_t BCPD = 0xff69;
+    static constexpr uint16_t OCPS = 0xff6a;
+    static constexpr uint16_t OCPD = 0xff6b;
+
+    constexpr static uint32_t colors[] = {0xffffffff, 0xffaaaaaa, 0xff555555, 0xff000000};
+};
+
+struct OAMEntry
+{
+    uint8_t y_pos;
+    uint8_t x_pos;
+    uint8_t tile_index;
+    uint8_t cgb_palette_number : 3;
+    uint8_t tile_vram_bank : 1;
+    uint8_t palette_number : 1;
+    uint8_t x_flip : 1;
+    uint8_t y_flip : 1;
+    uint8_t bg_prio : 1;
+};
+
+// One bit per pixel of a 160 pixels line, pixel x is bit (x % 64) of word (x / 64)
+struct Bitplane
+{
+    static constexpr size_t WORDS = 3;
+
+    uint64_t words[WORDS] = {};
+};
+
+// A line split in bitplanes so that layers can be combined with word wide operations, planes are laid out as in
+// FrameOutput::write_line
+struct Scanline
+{
+    Bitplane planes[FrameOutput::PLANES];
+    Bitplane opaque;
+    Bitplane prio;
+};
+
+// Last composition of a line and the inputs it was composed from
+struct LineCache
+{
+    uint64_t fingerprint = 0;
+    uint64_t stamp = 0;
+    uint64_t palette_stamp = 0;
+    Bitplane planes[FrameOutput::PLANES];
+    bool valid = false;
+};
+
+// VRAM banks, OAM, LCD registers and CGB palette RAM, either the instance's memory or a copy kept by the render thread
+struct VideoMemory
+{
+    uint8_t* vram[2] = {};
+    uint8_t* oam = nullptr;
+    uint8_t* io = nullptr;
+    uint8_t* palette_ram = nullptr;
+    bool cgb = false;
+};
+
+inline uint8_t vram_bank(const VideoMemory& mem)
+{
+    return mem.cgb ? mem.io[LCD::VBK & 0x7f] & 1 : 0;
+}
+
+// Byte of the palette RAM selected by BCPS or OCPS for a write to BCPD or OCPD
+inline size_t palette_index(const VideoMemory& mem, uint16_t addr)
+{
+    return (addr == LCD::OCPD) * 64 + (mem.io[(addr - 1) & 0x7f] & 0x3f);
+}
+
+// Stores a CPU write to VRAM, OAM, the LCD registers or the CGB palette RAM
+void store_video(const VideoMemory& mem, uint16_t addr, uint8_t value);
+
+// Stores a DMA transfer, the block is either within VRAM or within OAM
+void store_video_block(const VideoMemory& mem, uint16_t addr, const uint8_t* data, size_t size);
+
+size_t select_sprites(const OAMEntry* oam, uint8_t lcdc, uint8_t ly, const OAMEntry** sprites);
+
+// Produces lines from the video memory it is attached to
+struct Renderer
+{
+    void attach(const VideoMemory& mem);
+    void reset();
+    void set_color_correction(ColorCorrection correction);
+    bool set_output(PixelFormat format, uint32_t downsample, uint32_t crop_x, uint32_t crop_y, uint32_t crop_width,
+                    uint32_t crop_height);
+    void invalidate_lines();
+    bool line_changed(uint8_t ly) const;
+
+    void begin_frame();
+    void end_frame();
+    void render_line(uint8_t ly);
+    void write(uint16_t addr, uint8_t value);
+    void write_block(uint16_t addr, const uint8_t* data, size_t size);
+
+    inline uint8_t reg(uint16_t addr) const
+    {
+        return mem.io[addr & 0x7f];
+    }
+
+    VideoMemory mem;
+    const OAMEntry* oam = nullptr;
+
+    uint8_t window_line = 0;
+
+    // CGB palettes are converted to RGBA when they are written, lines only look up the converted colours
+    ColorCorrection color_correction = ColorCorrection::NONE;
+    uint16_t dirty_palettes = 0xffff;
+    uint64_t palette_stamp = 0;
+
+    // VRAM writes that change a value are stamped so that lines know if their tiles were modified, both banks share
+    // the stamps
+    uint64_t vram_clock = 0;
+    uint64_t tile_data_stamp = 0;
+    uint64_t tile_stamps[LCD::TILE_DATA_SIZE / 16] = {};
+    uint64_t map_stamps[2][32] = {};
+    LineCache lines[LCD::HEIGHT];
+
+    // Lines whose pixels differ from the previous rendered frame
+    uint64_t changed_lines[(LCD::HEIGHT + 63) / 64] = {};
+    uint64_t pending_changed_lines[(LCD::HEIGHT + 63) / 64] = {};
+
+    FrameOutput output;
+
+private:
+    void refresh_palettes();
+    void stamp_vram(uint16_t offset);
+    void compose_line(uint8_t ly, bool window, const OAMEntry** sprites, size_t n_sprites, Bitplane* planes) const;
+    uint64_t line_fingerprint(uint8_t ly, bool window, const OAMEntry** sprites, size_t n_sprites) const;
+    bool tiles_written(uint8_t ly, bool window, const OAMEntry** sprites, size_t n_sprites, uint64_t since) const;
+};
@@ -0,0 +1,312 @@
+#include "rewind.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "gameboy.h"
+#include "snapshot.h"
+
+// Raw frame layout before compression: a bitmap of the pages present, the present pages, then the flags and the
+// savestate. A keyframe has every page, a delta only the pages that changed, XORed with the previous frame
+static constexpr size_t BITMAP_SIZE = (Memory::STATE_PAGES + 7) / 8;
+static constexpr size_t FLAGS_SIZE = 2;
+
+static constexpr size_t MIN_RUN = 3;
+static constexpr size_t MAX_RUN = 0x7f + MIN_RUN;
+static constexpr size_t MAX_LITERAL = 0x80;
+
+// Control byte 0x80 | (length - MIN_RUN) followed by the repeated byte, or length - 1 followed by a literal
+static void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+    size_t literal = 0;
+    auto flush_literal = [&](size_t end) {
+        while (literal < end)
+        {
+            size_t n = std::min(end - literal, MAX_LITERAL);
+            out.push_back(uint8_t(n - 1));
+            out.insert(out.end(), data + literal, data + literal + n);
+            literal += n;
+        }
+    };
+
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t run = 1;
+        while (i + run < size && run < MAX_RUN && data[i + run] == data[i])
+        {
+            ++run;
+        }
+        if (run >= MIN_RUN)
+        {
+            flush_literal(i);
+            out.push_back(uint8_t(0x80 | (run - MIN_RUN)));
+            out.push_back(data[i]);
+            literal = i + run;
+        }
+        i += run;
+    }
+    flush_literal(size);
+}
+
+static void decompress(const std::vector<uint8_t>& data, std::vector<uint8_t>& out)
+{
+    out.clear();
+    for (size_t i = 0; i < data.size();)
+    {
+        uint8_t control = data[i++];
+        if (control & 0x80)
+        {
+            out.insert(out.end(), (control & 0x7f) + MIN_RUN, data[i++]);
+        }
+        else
+        {
+            out.insert(out.end(), data.begin() + i, data.begin() + i + control + 1);
+            i += control + 1;
+        }
+    }
+}
+
+static void xor_into(uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        dst[i] = a[i] ^ b[i];
+    }
+}
+
+// `prev` is null for a keyframe
+static void encode(const Snapshot& snapshot, const Snapshot* prev, std::vector<uint8_t>& out)
+{
+    out.assign(BITMAP_SIZE, 0);
+    for (size_t i = 0; i < Memory::STATE_PAGES; ++i)
+    {
+        // Shared pages are equal, different pages may still be equal if they were rewritten
+        if (prev && prev->pages[i] == snapshot.pages[i])
+        {
+            continue;
+        }
+        out[i / 8] |= 1 << (i % 8);
+        size_t offset = out.size();
+        out.resize(offset + Memory::PAGE_SIZE);
+        if (prev)
+        {
+            xor_into(out.data() + offset, snapshot.pages[i]->data, prev->pages[i]->data, Memory::PAGE_SIZE);
+        }
+        else
+        {
+            memcpy(out.data() + offset, snapshot.pages[i]->data, Memory::PAGE_SIZE);
+        }
+    }
+
+    size_t offset = out.size();
+    out.resize(offset + FLAGS_SIZE + snapshot.state.size());
+    uint8_t* state = out.data() + offset;
+    state[0] = snapshot.cgb ^ (prev ? prev->cgb : false);
+    state[1] = snapshot.bus_blocked ^ (prev ? prev->bus_blocked : false);
+    if (prev)
+    {
+        xor_into(state + FLAGS_SIZE, snapshot.state.data(), prev->state.data(), snapshot.state.size());
+    }
+    else
+    {
+        memcpy(state + FLAGS_SIZE, snapshot.state.data(), snapshot.state.size());
+    }
+}
+
+// XOR is its own inverse, the same delta goes from a frame to the next one and back. `from` is null for a keyframe
+static std::shared_ptr<const Snapshot> decode(const Snapshot* from, const std::vector<uint8_t>& raw)
+{
+    auto snapshot = std::make_shared<Snapshot>();
+    const uint8_t* data = raw.data() + BITMAP_SIZE;
+    for (size_t i = 0; i < Memory::STATE_PAGES; ++i)
+    {
+        if (!(raw[i / 8] & (1 << (i % 8))))
+        {
+            ASSERT(from != nullptr);
+            snapshot->pages[i] = from->pages[i];
+            continue;
+        }
+        auto page = std::make_shared<SnapshotPage>();
+        if (from)
+        {
+            xor_into(page->data, data, from->pages[i]->data, Memory::PAGE_SIZE);
+        }
+        else
+        {
+            memcpy(page->data, data, Memory::PAGE_SIZE);
+        }
+        snapshot->pages[i] = std::move(page);
+        data += Memory::PAGE_SIZE;
+    }
+
+    const uint8_t* end = raw.data() + raw.size();
+    snapshot->cgb = data[0] ^ (from ? from->cgb : false);
+    snapshot->bus_blocked = data[1] ^ (from ? from->bus_blocked : false);
+    data += FLAGS_SIZE;
+    snapshot->state.assign(data, end);
+    if (from)
+    {
+        ASSERT(from->state.size() == snapshot->state.size());
+        xor_into(snapshot->state.data(), data, from->state.data(), snapshot->state.size());
+    }
+    return snapshot;
+}
+
+Rewind::Rewind(size_t _budget, uint32_t _keyframe_interval) : budget(_budget), keyframe_interval(_keyframe_interval)
+{
+    thread = std::thread(&Rewind::run, this);
+}
+
+Rewind::~Rewind()
+{
+    quit.store(true, std::memory_order_release);
+    sequence.fetch_add(1, std::memory_order_release);
+    sequence.notify_one();
+    thread.join();
+}
+
+void Rewind::push(Gameboy& gb)
+{
+    if (!queue.push(take_snapshot(gb)))
+    {
+        // The next delta is taken against the last frame the worker saw
+        dropped++;
+        return;
+    }
+    submitted++;
+    sequence.fetch_add(1, std::memory_order_release);
+    sequence.notify_one();
+}
+
+bool Rewind::step_back(Gameboy& gb)
+{
+    wait_idle();
+    std::lock_guard lock(mutex);
+    if (entries.size() < 2)
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> raw;
+    if (!entries.back().keyframe)
+    {
+        decompress(entries.back().data, raw);
+        latest = decode(latest.get(), raw);
+    }
+    else
+    {
+        // Replay the previous group from its keyframe
+        size_t key = entries.size() - 2;
+        while (!entries[key].keyframe)
+        {
+            --key;
+        }
+        latest = nullptr;
+        for (size_t i = key; i < entries.size() - 1; ++i)
+        {
+            decompress(entries[i].data, raw);
+            latest = decode(latest.get(), raw);
+        }
+    }
+    used -= entries.back().data.capacity() + sizeof(Entry);
+    entries.pop_back();
+    entry_count = entries.size();
+
+    since_keyframe = 0;
+    for (size_t i = entries.size(); i-- > 0 && !entries[i].keyframe;)
+    {
+        since_keyframe++;
+    }
+    since_keyframe++;
+
+    restore_snapshot(gb, latest);
+    return true;
+}
+
+void Rewind::clear()
+{
+    wait_idle();
+    std::lock_guard lock(mutex);
+    entries.clear();
+    entry_count = 0;
+    latest = nullptr;
+    since_keyframe = 0;
+    used = 0;
+}
+
+size_t Rewind::frames()
+{
+    return entry_count.load(std::memory_order_relaxed);
+}
+
+size_t Rewind::memory_used()
+{
+    return used.load(std::memory_order_relaxed);
+}
+
+void Rewind::run()
+{
+    while (true)
+    {
+        uint32_t seen = sequence.load(std::memory_order_acquire);
+        std::shared_ptr<const Snapshot> snapshot;
+        while (queue.pop(&snapshot, 1) == 1)
+        {
+            append(std::move(snapshot));
+            processed.fetch_add(1, std::memory_order_release);
+            processed.notify_all();
+        }
+        if (quit.load(std::memory_order_acquire))
+        {
+            break;
+        }
+        sequence.wait(seen, std::memory_order_acquire);
+    }
+}
+
+void Rewind::append(std::shared_ptr<const Snapshot> snapshot)
+{
+    bool keyframe = latest == nullptr || since_keyframe >= keyframe_interval ||
+                    latest->state.size() != snapshot->state.size();
+    encode(*snapshot, keyframe ? nullptr : latest.get(), scratch);
+
+    Entry entry;
+    entry.keyframe = keyframe;
+    std::vector<uint8_t> compressed;
+    compressed.reserve(scratch.size() / 4);
+    compress(scratch.data(), scratch.size(), compressed);
+    entry.data.assign(compressed.begin(), compressed.end());
+    since_keyframe = keyframe ? 1 : since_keyframe + 1;
+    latest = std::move(snapshot);
+
+    std::lock_guard lock(mutex);
+    used += entry.data.capacity() + sizeof(Entry);
+    entries.push_back(std::move(entry));
+
+    // Drop whole groups so that the history always starts with a keyframe, the last group is always kept
+    while (used > budget)
+    {
+        auto next = std::find_if(entries.begin() + 1, entries.end(), [](const Entry& e) { return e.keyframe; });
+        if (next == entries.end())
+        {
+            break;
+        }
+        for (auto it = entries.begin(); it != next; ++it)
+        {
+            used -= it->data.capacity() + sizeof(Entry);
+        }
+        entries.erase(entries.begin(), next);
+    }
+    entry_count = entries.size();
+}
+
+void Rewind::wait_idle()
+{
+    uint64_t done = processed.load(std::memory_order_acquire);
+    while (done != submitted)
+    {
+        processed.wait(done, std::memory_order_acquire);
+        done = processed.load(std::memory_order_acquire);
+    }
+}
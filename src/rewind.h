@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "ring_buffer.h"
+
+struct Gameboy;
+struct Snapshot;
+
+// Frame history for rewinding. The emulation thread only takes an incremental snapshot per frame, which copies the
+// dirty pages, and hands it to a worker thread. The worker stores a keyframe every `keyframe_interval` frames and the
+// XOR against the previous frame otherwise, run-length compressed. The oldest keyframe and its deltas are dropped when
+// the history grows past `budget` bytes
+struct Rewind
+{
+    static constexpr size_t QUEUE_SIZE = 64;
+
+    Rewind(size_t budget = 64 << 20, uint32_t keyframe_interval = 60);
+    ~Rewind();
+
+    Rewind(const Rewind&) = delete;
+    Rewind& operator=(const Rewind&) = delete;
+
+    // Emulation thread, called at the end of every frame
+    void push(Gameboy& gb);
+    // Restores the frame before the last one recorded and forgets the last one, false when the history is empty
+    bool step_back(Gameboy& gb);
+    void clear();
+
+    size_t frames();
+    size_t memory_used();
+
+    size_t budget;
+    uint32_t keyframe_interval;
+    uint64_t dropped = 0;
+
+private:
+    struct Entry
+    {
+        std::vector<uint8_t> data;
+        bool keyframe = false;
+    };
+
+    void run();
+    void append(std::shared_ptr<const Snapshot> snapshot);
+    void wait_idle();
+
+    RingBuffer<std::shared_ptr<const Snapshot>, QUEUE_SIZE> queue;
+    std::atomic<uint64_t> processed = 0;
+    uint64_t submitted = 0;
+    std::atomic<uint32_t> sequence = 0;
+    std::atomic<bool> quit = false;
+
+    // `latest` is the decoded state of the last entry. Only touched by the worker, and by step_back and clear once the
+    // worker is idle, so that encoding and compression run without the lock
+    std::shared_ptr<const Snapshot> latest;
+    uint32_t since_keyframe = 0;
+    std::vector<uint8_t> scratch;
+
+    // Guarded by `mutex`, the counters are read by the UI at any time
+    std::mutex mutex;
+    std::deque<Entry> entries;
+    std::atomic<size_t> entry_count = 0;
+    std::atomic<size_t> used = 0;
+
+    std::thread thread;
+};
@@ -0,0 +1,244 @@
+#include "savestate.h"
+
+#include <cstring>
+#include <type_traits>
+
+#include "gameboy.h"
+
+static constexpr size_t SECTION_COUNT = static_cast<size_t>(StateSection::Count);
+static constexpr size_t TABLE_OFFSET = sizeof(SaveStateHeader);
+
+// Lists the blocks of a section, used by both save and load so that they cannot disagree. Pointers, caches, host
+// resources (render thread, audio buffer, sinks) and frontend settings are left out
+template <typename F>
+static void for_each_block(Gameboy& gb, StateSection section, F&& block)
+{
+    auto pod = [&](auto& value) {
+        static_assert(std::is_trivially_copyable_v<std::remove_reference_t<decltype(value)>>);
+        block(&value, sizeof(value));
+    };
+
+    switch (section)
+    {
+    case StateSection::CART:
+        pod(gb.cart_info);
+        break;
+    case StateSection::CPU:
+        pod(gb.cpu);
+        break;
+    case StateSection::SCHEDULER:
+        pod(gb.scheduler);
+        break;
+    case StateSection::MEMORY:
+        // The ROM is not saved, the state is loaded on top of it
+        pod(gb.memory.ram);
+        pod(gb.memory.vram_bank1);
+        pod(gb.memory.palette_ram);
+        pod(gb.memory.cgb);
+        pod(gb.memory.bus_blocked);
+        break;
+    case StateSection::INTERRUPTS:
+        pod(gb.interrupts);
+        break;
+    case StateSection::TIMER:
+        pod(gb.timer);
+        break;
+    case StateSection::SERIAL:
+        pod(gb.serial.sb);
+        pod(gb.serial.sc);
+        break;
+    case StateSection::PPU:
+        pod(gb.ppu.frame_start);
+        pod(gb.ppu.current_frame);
+        pod(gb.ppu.frame_count);
+        pod(gb.ppu.rendered_lines);
+        pod(gb.ppu.fixed_line);
+        pod(gb.ppu.fixed_hblank);
+        pod(gb.ppu.rendering);
+        pod(gb.ppu.frame_rendered);
+        pod(gb.ppu.renderer.window_line);
+        break;
+    case StateSection::APU:
+        pod(gb.apu.square1);
+        pod(gb.apu.square2);
+        pod(gb.apu.wave);
+        pod(gb.apu.noise);
+        pod(gb.apu.regs);
+        pod(gb.apu.wave_ram);
+        pod(gb.apu.power);
+        pod(gb.apu.frame_step);
+        pod(gb.apu.last_time);
+        break;
+    case StateSection::DMA:
+        pod(gb.dma);
+        break;
+    case StateSection::HDMA:
+        pod(gb.hdma);
+        break;
+    default:
+        ASSERT_MSG(false, "Unknown state section");
+        break;
+    }
+}
+
+static size_t section_size(Gameboy& gb, StateSection section)
+{
+    size_t size = 0;
+    for_each_block(gb, section, [&](void*, size_t block_size) { size += block_size; });
+    return size;
+}
+
+static size_t align(size_t offset)
+{
+    return (offset + 7) & ~size_t(7);
+}
+
+// Written so that a corrupt offset cannot wrap around
+static bool in_bounds(const SaveStateSection& entry, size_t size)
+{
+    return entry.offset <= size && entry.size <= size - entry.offset;
+}
+
+// Unknown ids are skipped, they may come from a newer version of a section list
+static bool selected(const SaveStateSection& entry, uint32_t sections)
+{
+    return entry.id < SECTION_COUNT && (sections & (1u << entry.id));
+}
+
+// The title and header checksum of the cartridge the state was saved with
+static bool same_cartridge(const Gameboy& gb, const uint8_t* data, size_t size, const SaveStateSection& entry)
+{
+    CartInfo saved;
+    if (entry.size != sizeof(saved) || !in_bounds(entry, size))
+    {
+        return false;
+    }
+    memcpy(&saved, data + entry.offset, sizeof(saved));
+    return saved.header_checksum == gb.cart_info.header_checksum
+           && memcmp(saved.title, gb.cart_info.title, sizeof(saved.title)) == 0;
+}
+
+void save_state(Gameboy& gb, std::vector<uint8_t>& out, uint32_t sections)
+{
+    // The lazily synthesized audio has to reach the current time for the frame sequencer state to be complete
+    gb.apu.catch_up(gb);
+    if (sections & section_bit(StateSection::PPU))
+    {
+        gb.ppu.sync_window_line();
+    }
+
+    SaveStateSection table[SECTION_COUNT];
+    size_t count = 0;
+    size_t offset = TABLE_OFFSET;
+    for (size_t i = 0; i < SECTION_COUNT; ++i)
+    {
+        if (sections & (1u << i))
+        {
+            table[count++] = {uint32_t(i), uint32_t(section_size(gb, StateSection(i))), 0};
+            offset += sizeof(SaveStateSection);
+        }
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        offset = align(offset);
+        table[i].offset = offset;
+        offset += table[i].size;
+    }
+
+    out.resize(offset);
+    SaveStateHeader header = {};
+    memcpy(header.magic, SaveStateHeader::MAGIC, sizeof(header.magic));
+    header.version = SaveStateHeader::VERSION;
+    header.section_count = uint32_t(count);
+    header.size = offset;
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + TABLE_OFFSET, table, count * sizeof(SaveStateSection));
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t* dst = out.data() + table[i].offset;
+        for_each_block(gb, StateSection(table[i].id), [&](void* src, size_t size) {
+            memcpy(dst, src, size);
+            dst += size;
+        });
+    }
+}
+
+bool load_state(Gameboy& gb, const uint8_t* data, size_t size, uint32_t sections)
+{
+    SaveStateHeader header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SaveStateHeader::MAGIC, sizeof(header.magic)) != 0
+        || header.version != SaveStateHeader::VERSION || header.size > size
+        || TABLE_OFFSET + header.section_count * sizeof(SaveStateSection) > size)
+    {
+        return false;
+    }
+
+    // Everything is checked before the state is touched. The state is loaded on top of the ROM, it has to be the one
+    // the state was saved with
+    if (!gb.memory.rom)
+    {
+        return false;
+    }
+    const SaveStateSection* table = (const SaveStateSection*)(data + TABLE_OFFSET);
+    uint32_t found = 0;
+    for (size_t i = 0; i < header.section_count; ++i)
+    {
+        SaveStateSection entry;
+        memcpy(&entry, table + i, sizeof(entry));
+        if (entry.id == uint32_t(StateSection::CART) && !same_cartridge(gb, data, size, entry))
+        {
+            return false;
+        }
+        if (!selected(entry, sections))
+        {
+            continue;
+        }
+        if (entry.size != section_size(gb, StateSection(entry.id)) || !in_bounds(entry, size))
+        {
+            return false;
+        }
+        found |= 1u << entry.id;
+    }
+    if ((found & sections) != (sections & ALL_SECTIONS))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < header.section_count; ++i)
+    {
+        SaveStateSection entry;
+        memcpy(&entry, table + i, sizeof(entry));
+        if (!selected(entry, found))
+        {
+            continue;
+        }
+        const uint8_t* src = data + entry.offset;
+        for_each_block(gb, StateSection(entry.id), [&](void* dst, size_t block_size) {
+            memcpy(dst, src, block_size);
+            src += block_size;
+        });
+    }
+
+    // Rebuilds what is derived from the loaded state
+    if (found & section_bit(StateSection::MEMORY))
+    {
+        gb.memory.map_vram();
+        gb.memory.set_bus_blocked(gb.memory.bus_blocked);
+        gb.memory.mark_all_dirty();
+    }
+    if (found & (section_bit(StateSection::MEMORY) | section_bit(StateSection::PPU)))
+    {
+        gb.ppu.restore(gb);
+    }
+    if (found & (section_bit(StateSection::APU) | section_bit(StateSection::SCHEDULER)))
+    {
+        gb.apu.restart_output(gb);
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "common.h"
+
+struct Gameboy;
+
+enum class StateSection : uint32_t
+{
+    CART,
+    CPU,
+    SCHEDULER,
+    MEMORY,
+    INTERRUPTS,
+    TIMER,
+    SERIAL,
+    PPU,
+    APU,
+    DMA,
+    HDMA,
+    Count
+};
+
+// Binary savestate: a header, a table of sections and the sections. A section is a few POD blocks copied with memcpy
+// in both directions, the table gives their offset and size so that a load can be restricted to some of them. The
+// blocks are the in-memory layout of the structs, VERSION changes with them
+struct SaveStateHeader
+{
+    static constexpr char MAGIC[8] = {'B', 'A', 'D', 'G', 'S', 'T', 'A', 'T'};
+    static constexpr uint32_t VERSION = 3;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t size;
+};
+
+struct SaveStateSection
+{
+    uint32_t id;
+    uint32_t size;
+    uint64_t offset;
+};
+
+static constexpr uint32_t ALL_SECTIONS = (1u << static_cast<uint32_t>(StateSection::Count)) - 1;
+
+constexpr uint32_t section_bit(StateSection section)
+{
+    return 1u << static_cast<uint32_t>(section);
+}
+
+// `out` keeps its capacity between saves
+void save_state(Gameboy& gb, std::vector<uint8_t>& out, uint32_t sections = ALL_SECTIONS);
+bool load_state(Gameboy& gb, const uint8_t* data, size_t size, uint32_t sections = ALL_SECTIONS);
@@ -0,0 +1,41 @@
+#include "scheduler.h"
+
+void Scheduler::reset()
+{
+    now = 0;
+    next = NEVER;
+    for (auto& deadline : deadlines.data)
+    {
+        deadline = NEVER;
+    }
+}
+
+void Scheduler::schedule(Event event, uint64_t when)
+{
+    deadlines[event] = when;
+    update_next();
+}
+
+void Scheduler::cancel(Event event)
+{
+    deadlines[event] = NEVER;
+    update_next();
+}
+
+Event Scheduler::next_event() const
+{
+    size_t next_index = 0;
+    for (size_t i = 1; i < EnumArray<Event, uint64_t>::SIZE; ++i)
+    {
+        if (deadlines.data[i] < deadlines.data[next_index])
+        {
+            next_index = i;
+        }
+    }
+    return static_cast<Event>(next_index);
+}
+
+void Scheduler::update_next()
+{
+    next = deadlines[next_event()];
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+#include "enum_array.h"
+
+enum class Event
+{
+    PPU,
+    TIMER,
+    SERIAL,
+    HDMA,
+    OAM_DMA,
+    APU,
+    SYNC, // No-op, bounds how far a halted CPU skips when instances run in lockstep
+    Count
+};
+
+// Keeps one deadline per event kind, timestamps are in dots (4 per CPU cycle) since reset
+struct Scheduler
+{
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    void reset();
+    void schedule(Event event, uint64_t when);
+    void cancel(Event event);
+    Event next_event() const;
+
+    inline bool pending() const
+    {
+        return now >= next;
+    }
+
+    uint64_t now = 0;
+    uint64_t next = NEVER;
+    EnumArray<Event, uint64_t> deadlines = {};
+
+private:
+    void update_next();
+};
@@ -0,0 +1,120 @@
+#include "serial.h"
+
+#include "gameboy.h"
+#include "link.h"
+
+SerialFileSink::SerialFileSink(FILE* _file) : file(_file)
+{
+}
+
+void SerialFileSink::write(const uint8_t* data, size_t size)
+{
+    fwrite(data, 1, size, file);
+    fflush(file);
+}
+
+void SerialLog::write(const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        char c = data[i];
+        if (c == '\n' || lines.back().size() >= LINE_LENGTH)
+        {
+            lines.emplace_back();
+            if (lines.size() > MAX_LINES)
+            {
+                lines.pop_front();
+            }
+        }
+        if (c != '\n')
+        {
+            lines.back().push_back(c);
+        }
+    }
+}
+
+void SerialLog::clear()
+{
+    lines = {""};
+}
+
+void Serial::reset(Gameboy& gb)
+{
+    sb = 0x00;
+    sc = 0x7e;
+    sent.clear();
+    dropped = 0;
+    gb.scheduler.cancel(Event::SERIAL);
+}
+
+uint8_t Serial::read(const Gameboy& gb, uint16_t addr) const
+{
+    if (addr == SB)
+    {
+        return sb;
+    }
+    return sc | (gb.memory.cgb ? 0x7c : 0x7e);
+}
+
+void Serial::write(Gameboy& gb, uint16_t addr, uint8_t value)
+{
+    if (addr == SB)
+    {
+        sb = value;
+        return;
+    }
+
+    sc = value;
+    // An external clock transfer waits for the other end of the link
+    if (bit(sc, 7) && bit(sc, 0))
+    {
+        uint32_t dots_per_bit = gb.memory.cgb && bit(sc, 1) ? FAST_DOTS_PER_BIT : DOTS_PER_BIT;
+        uint64_t when = gb.scheduler.now + 8 * dots_per_bit;
+        gb.scheduler.schedule(Event::SERIAL, when);
+        if (link)
+        {
+            link->start(gb, sb, when);
+        }
+    }
+    else if (!link || link->cancel(gb))
+    {
+        gb.scheduler.cancel(Event::SERIAL);
+    }
+}
+
+void Serial::on_event(Gameboy& gb)
+{
+    // Without a link or a ready partner the bits shifted in are all 1
+    uint8_t received = link ? link->exchange(gb, bit(sc, 7) ? sb : 0xff) : 0xff;
+    if (!bit(sc, 7))
+    {
+        return;
+    }
+
+    if (!sent.push(sb))
+    {
+        dropped += 1;
+    }
+    sb = received;
+    set_bit(sc, 7, 0);
+    gb.interrupts.request(Interrupt::SERIAL);
+}
+
+void Serial::drain()
+{
+    uint8_t buffer[QUEUE_SIZE];
+    size_t size = sent.pop(buffer, QUEUE_SIZE);
+    if (size == 0)
+    {
+        return;
+    }
+    for (auto& sink : sinks)
+    {
+        sink->write(buffer, size);
+    }
+}
+
+void Serial::add_sink(std::shared_ptr<SerialSink> sink)
+{
+    sinks.push_back(std::move(sink));
+}
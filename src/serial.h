@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "ring_buffer.h"
+
+struct Gameboy;
+struct LinkCable;
+
+// Receives the bytes sent on the serial port
+struct SerialSink
+{
+    virtual ~SerialSink() = default;
+    virtual void write(const uint8_t* data, size_t size) = 0;
+};
+
+// Streams to a file, stdout or a file descriptor opened with fdopen
+struct SerialFileSink : SerialSink
+{
+    explicit SerialFileSink(FILE* file);
+    void write(const uint8_t* data, size_t size) override;
+
+    FILE* file = nullptr;
+};
+
+// Keeps the last lines for the UI, long lines are wrapped so that the UI only lays out the visible ones
+struct SerialLog : SerialSink
+{
+    static constexpr size_t MAX_LINES = 10000;
+    static constexpr size_t LINE_LENGTH = 80;
+
+    void write(const uint8_t* data, size_t size) override;
+    void clear();
+
+    std::deque<std::string> lines = {""};
+};
+
+// SB and SC. A transfer completes after 8 bits at the serial clock rate, the sent bytes are queued and forwarded to
+// the sinks when the queue is drained, at the end of each frame or by the UI. With a link cable the byte is exchanged
+// with the other instance, which completes an external clock transfer at the same time
+struct Serial
+{
+    static constexpr uint16_t SB = 0xff01;
+    static constexpr uint16_t SC = 0xff02;
+
+    static constexpr uint32_t DOTS_PER_BIT = 512;
+    static constexpr uint32_t FAST_DOTS_PER_BIT = 16;
+    static constexpr size_t QUEUE_SIZE = 4096;
+
+    void reset(Gameboy& gb);
+    uint8_t read(const Gameboy& gb, uint16_t addr) const;
+    void write(Gameboy& gb, uint16_t addr, uint8_t value);
+    void on_event(Gameboy& gb);
+    void drain();
+    void add_sink(std::shared_ptr<SerialSink> sink);
+
+    uint8_t sb = 0;
+    uint8_t sc = 0;
+
+    RingBuffer<uint8_t, QUEUE_SIZE> sent;
+    uint64_t dropped = 0;
+    std::vector<std::shared_ptr<SerialSink>> sinks;
+    LinkCable* link = nullptr;
+};
@@ -0,0 +1,91 @@
+#include "snapshot.h"
+
+#include <cstring>
+
+#include "gameboy.h"
+#include "savestate.h"
+
+// The snapshot keeps the memory pages and the cartridge itself
+static constexpr uint32_t STATE_SECTIONS =
+    ALL_SECTIONS & ~section_bit(StateSection::MEMORY) & ~section_bit(StateSection::CART);
+
+std::shared_ptr<const Snapshot> take_snapshot(Gameboy& gb)
+{
+    auto snapshot = std::make_shared<Snapshot>();
+    const Snapshot* parent = gb.snapshot_base.get();
+    Memory& mem = gb.memory;
+
+    for (size_t i = 0; i < Memory::STATE_PAGES; ++i)
+    {
+        std::span<uint8_t> page = mem.state_page(i);
+        // Pages written with the values they already had are still shared
+        if (parent && (!mem.is_dirty(i) || memcmp(parent->pages[i]->data, page.data(), page.size()) == 0))
+        {
+            snapshot->pages[i] = parent->pages[i];
+            continue;
+        }
+        auto copy = std::make_shared<SnapshotPage>();
+        memcpy(copy->data, page.data(), page.size());
+        snapshot->pages[i] = std::move(copy);
+    }
+    snapshot->rom = mem.rom;
+    snapshot->cart_info = gb.cart_info;
+    snapshot->cgb = mem.cgb;
+    snapshot->bus_blocked = mem.bus_blocked;
+    save_state(gb, snapshot->state, STATE_SECTIONS);
+
+    mem.clear_dirty();
+    gb.snapshot_base = snapshot;
+    return snapshot;
+}
+
+void restore_snapshot(Gameboy& gb, std::shared_ptr<const Snapshot> snapshot)
+{
+    const Snapshot* base = gb.snapshot_base.get();
+    Memory& mem = gb.memory;
+
+    // The memory matches the base except for the dirty pages
+    for (size_t i = 0; i < Memory::STATE_PAGES; ++i)
+    {
+        if (base && !mem.is_dirty(i) && base->pages[i] == snapshot->pages[i])
+        {
+            continue;
+        }
+        std::span<uint8_t> page = mem.state_page(i);
+        memcpy(page.data(), snapshot->pages[i]->data, page.size());
+    }
+    mem.cgb = snapshot->cgb;
+    mem.bus_blocked = snapshot->bus_blocked;
+    if (snapshot->rom && snapshot->rom != mem.rom)
+    {
+        mem.rom = snapshot->rom;
+        gb.cart_info = snapshot->cart_info;
+        mem.map_pages();
+    }
+    else
+    {
+        mem.map_vram();
+        mem.set_bus_blocked(mem.bus_blocked);
+    }
+
+    bool loaded = load_state(gb, snapshot->state.data(), snapshot->state.size(), STATE_SECTIONS);
+    ASSERT(loaded);
+
+    mem.clear_dirty();
+    gb.snapshot_base = std::move(snapshot);
+}
+
+void clone(Gameboy& gb, Gameboy& child)
+{
+    clone(take_snapshot(gb), child);
+}
+
+void clone(std::shared_ptr<const Snapshot> snapshot, Gameboy& child)
+{
+    // A new instance has never been reset
+    if (child.memory.owner != &child)
+    {
+        child.reset();
+    }
+    restore_snapshot(child, std::move(snapshot));
+}
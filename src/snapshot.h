@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "gameboy.h"
+
+struct SnapshotPage
+{
+    uint8_t data[Memory::PAGE_SIZE];
+};
+
+// Incremental snapshot. Memory pages that were not written since the parent snapshot are shared with it through
+// reference counting, the rest of the machine is a savestate without the memory and cartridge sections. The parent is
+// the snapshot last taken or restored on the instance, kept in Gameboy::snapshot_base, and the dirty pages are relative
+// to it
+struct Snapshot
+{
+    std::shared_ptr<const SnapshotPage> pages[Memory::STATE_PAGES];
+    // Null keeps the ROM and the cartridge header of the instance it is restored on
+    std::shared_ptr<const Rom> rom;
+    CartInfo cart_info;
+    std::vector<uint8_t> state;
+    bool cgb = false;
+    bool bus_blocked = false;
+};
+
+std::shared_ptr<const Snapshot> take_snapshot(Gameboy& gb);
+// Only copies back the pages that differ from the current memory
+void restore_snapshot(Gameboy& gb, std::shared_ptr<const Snapshot> snapshot);
+
+// Forks a machine into `child`, which may then run on another thread. Both keep the snapshot as their base, so the ROM
+// and the pages neither of them writes are shared. Only the first clone into a child copies everything, a child that
+// is cloned into again only copies the pages that differ. The child keeps its own sinks, link cable, capture, render
+// thread and audio setting. The parent must not be running while its snapshot is taken, forking many
+// children from one state should take one snapshot and clone it into each
+void clone(Gameboy& gb, Gameboy& child);
+void clone(std::shared_ptr<const Snapshot> snapshot, Gameboy& child);
@@ -3,64 +3,138 @@
 #include "gameboy.h"
 #include "interrupt.h"
 
-static uint8_t* timer_div = nullptr;
-static uint8_t* timer_tima = nullptr;
-static uint8_t* timer_tma = nullptr;
-static uint8_t* timer_tac = nullptr;
-
-static uint16_t internal_div = 0;
-static uint64_t internal_ticks = 0;
-
-void init_timer(Gameboy& gb)
+void Timer::reset(Gameboy& gb)
 {
-    timer_div = &gb.memory[0xff04];
-    timer_tima = &gb.memory[0xff05];
-    timer_tma = &gb.memory[0xff06];
-    timer_tac = &gb.memory[0xff07];
+    // Counter value after the boot ROM
+    counter_offset = 0xabcc - gb.scheduler.now;
+    tima_counter = counter(gb.scheduler.now);
+    reload_time = NEVER;
+    tima = 0;
+    tma = 0;
+    tac = 0xf8;
+    gb.scheduler.cancel(Event::TIMER);
 }
 
-void timer_tick(uint64_t cycles)
+uint8_t Timer::read(const Gameboy& gb, uint16_t addr) const
 {
-    internal_div += cycles * 4;
-    if (internal_div >= 256)
+    uint64_t now = gb.scheduler.now;
+    switch (addr)
     {
-        internal_div -= 256;
-        *timer_div += 1;
+    case DIV:
+        return counter(now) >> 8;
+    case TIMA:
+        return tima_at(now);
+    case TMA:
+        return tma;
+    default:
+        return tac;
     }
+}
+
+void Timer::write(Gameboy& gb, uint16_t addr, uint8_t value)
+{
+    uint64_t now = gb.scheduler.now;
 
-    if (*timer_tac & (1 << 2))
+    // TIMA reads 0 between the overflow and the reload, otherwise the predicted overflow is recomputed after the write
+    bool reloading = reload_time != NEVER && now + RELOAD_DOTS >= reload_time;
+    tima = tima_at(now);
+    tima_counter = counter(now);
+    if (!reloading)
     {
-        internal_ticks += cycles * 4;
+        reload_time = NEVER;
+    }
 
-        uint64_t freq = 4096;
-        if ((*timer_tac & 0b11) == 0b01)
-        {
-            freq = 262144;
-        }
-        else if ((*timer_tac & 0b11) == 0b10)
+    switch (addr)
+    {
+    case DIV:
+    {
+        // Clearing the counter is a falling edge when the selected bit was set
+        bool was_high = signal(now);
+        gb.apu.on_div_reset(gb);
+        counter_offset = -now;
+        tima_counter = 0;
+        if (was_high)
         {
-            freq = 65536;
+            increment(gb, now);
         }
-        else if ((*timer_tac & 0b11) == 0b11)
+        break;
+    }
+    case TIMA:
+        // Writing TIMA during the reload cycle cancels the reload and the interrupt
+        tima = value;
+        reload_time = NEVER;
+        break;
+    case TMA:
+        tma = value;
+        break;
+    default:
+    {
+        bool was_high = signal(now);
+        tac = value | 0xf8;
+        if (was_high && !signal(now))
         {
-            freq = 16384;
+            increment(gb, now);
         }
+        break;
+    }
+    }
 
-        while (internal_ticks >= 4194304 / freq)
-        {
-            *timer_tima += 1;
-            if (*timer_tima == 0)
-            {
-                *timer_tima = *timer_tma;
-                request_interrupt(Interrupt::TIMER);
-            }
-            internal_ticks -= 4194304 / freq;
-        }
+    schedule_overflow(gb, now);
+}
+
+void Timer::on_event(Gameboy& gb, uint64_t when)
+{
+    tima = tma;
+    tima_counter = counter(when);
+    reload_time = NEVER;
+    gb.interrupts.request(Interrupt::TIMER);
+    schedule_overflow(gb, when);
+}
+
+uint8_t Timer::tima_at(uint64_t now) const
+{
+    if (reload_time != NEVER && now + RELOAD_DOTS >= reload_time)
+    {
+        return 0;
+    }
+    if (!bit(tac, 2))
+    {
+        return tima;
     }
+    uint64_t p = period();
+    return tima + (counter(now) / p - tima_counter / p);
 }
 
-void timer_reset_div()
+bool Timer::signal(uint64_t now) const
 {
-    *timer_div = 0;
-    internal_div = 0;
+    return bit(tac, 2) && (counter(now) & (period() / 2));
+}
+
+void Timer::increment(Gameboy& gb, uint64_t now)
+{
+    tima += 1;
+    if (tima == 0)
+    {
+        reload_time = now + RELOAD_DOTS;
+        gb.scheduler.schedule(Event::TIMER, reload_time);
+    }
+}
+
+void Timer::schedule_overflow(Gameboy& gb, uint64_t now)
+{
+    if (reload_time != NEVER)
+    {
+        return;
+    }
+    if (!bit(tac, 2))
+    {
+        gb.scheduler.cancel(Event::TIMER);
+        return;
+    }
+
+    // The edge that takes TIMA from 0xff to 0
+    uint64_t p = period();
+    uint64_t edge = (tima_counter / p + (256 - tima)) * p;
+    reload_time = now + (edge - tima_counter) + RELOAD_DOTS;
+    gb.scheduler.schedule(Event::TIMER, reload_time);
 }
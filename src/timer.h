@@ -4,6 +4,46 @@
 
 struct Gameboy;
 
-void init_timer(Gameboy& gb);
-void timer_tick(uint64_t cycles);
-void timer_reset_div();
+// DIV is the upper byte of a 16 bits system counter incremented every dot. TIMA is incremented on the falling edges of
+// the counter bit selected by TAC, so both are computed from the current time. Only the overflow is scheduled, the
+// reload from TMA and the interrupt happen one CPU cycle after it.
+struct Timer
+{
+    static constexpr uint16_t DIV = 0xff04;
+    static constexpr uint16_t TIMA = 0xff05;
+    static constexpr uint16_t TMA = 0xff06;
+    static constexpr uint16_t TAC = 0xff07;
+
+    static constexpr uint32_t RELOAD_DOTS = 4;
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    void reset(Gameboy& gb);
+    uint8_t read(const Gameboy& gb, uint16_t addr) const;
+    void write(Gameboy& gb, uint16_t addr, uint8_t value);
+    void on_event(Gameboy& gb, uint64_t when);
+
+    inline uint64_t counter(uint64_t now) const
+    {
+        return now + counter_offset;
+    }
+
+    // Dots between two falling edges of the selected counter bit
+    inline uint64_t period() const
+    {
+        static constexpr uint64_t periods[] = {1024, 16, 64, 256};
+        return periods[tac & 3];
+    }
+
+    uint64_t counter_offset = 0;
+    uint64_t tima_counter = 0;
+    uint64_t reload_time = NEVER;
+    uint8_t tima = 0;
+    uint8_t tma = 0;
+    uint8_t tac = 0;
+
+private:
+    uint8_t tima_at(uint64_t now) const;
+    bool signal(uint64_t now) const;
+    void increment(Gameboy& gb, uint64_t now);
+    void schedule_overflow(Gameboy& gb, uint64_t now);
+};
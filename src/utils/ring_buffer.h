@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// Bounded single producer single consumer queue, N is a power of 2
+template <typename T, size_t N>
+struct RingBuffer
+{
+    static_assert((N & (N - 1)) == 0);
+    static constexpr size_t CAPACITY = N;
+
+    RingBuffer() = default;
+
+    // Copies serve as moves too, instances holding a queue stay nothrow movable
+    RingBuffer(const RingBuffer& other) noexcept(std::is_nothrow_copy_assignable_v<T>)
+    {
+        *this = other;
+    }
+
+    RingBuffer& operator=(const RingBuffer& other) noexcept(std::is_nothrow_copy_assignable_v<T>)
+    {
+        head.store(other.head.load(std::memory_order_acquire), std::memory_order_relaxed);
+        tail.store(other.tail.load(std::memory_order_acquire), std::memory_order_relaxed);
+        for (size_t i = 0; i < N; ++i)
+        {
+            data[i] = other.data[i];
+        }
+        return *this;
+    }
+
+    // Producer
+    bool push(const T& value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+        {
+            return false;
+        }
+        data[t % N] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer, returns the number of values popped
+    size_t pop(T* out, size_t max)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t n = tail.load(std::memory_order_acquire) - h;
+        n = n < max ? n : max;
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = std::move(data[(h + i) % N]);
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    void clear()
+    {
+        head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    T data[N] = {};
+};
@@ -0,0 +1,129 @@
+// Lockstep lanes must end every frame in the state run_frame() gives to a copy of the same instance
+
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <random>
+
+#include "lockstep.h"
+
+static std::shared_ptr<Rom> make_rom(std::initializer_list<uint8_t> code)
+{
+    auto rom = std::make_shared<Rom>();
+    memcpy(rom->data + 0x100, code.begin(), code.size());
+    return rom;
+}
+
+// Register only instructions with forward conditional jumps, so that the lanes split and join again
+static std::shared_ptr<Rom> make_random_rom(std::mt19937& rng)
+{
+    static constexpr uint8_t OPS[] = {0x04, 0x05, 0x0c, 0x0d, 0x3c, 0x3d, 0x07, 0x0f, 0x17, 0x1f, 0x2f, 0x37, 0x3f,
+                                      0x41, 0x4f, 0x57, 0x78, 0x80, 0x88, 0x91, 0x9a, 0xa3, 0xac, 0xb5, 0xb8, 0x00};
+    auto rom = std::make_shared<Rom>();
+    uint8_t* p = rom->data + 0x100;
+    while (p < rom->data + 0x4000)
+    {
+        uint32_t k = rng() % 8;
+        if (k == 0)
+        {
+            // JR cc over the next instruction
+            *p++ = 0x20 | ((rng() & 3) << 3);
+            *p++ = 1;
+        }
+        else if (k == 1)
+        {
+            // LD (C1xx),A
+            *p++ = 0xea;
+            *p++ = uint8_t(rng());
+            *p++ = 0xc1;
+            continue;
+        }
+        *p++ = OPS[rng() % sizeof(OPS)];
+    }
+    p[0] = 0xc3;
+    p[1] = 0x00;
+    p[2] = 0x01;
+    return rom;
+}
+
+static bool same_state(const Gameboy& a, const Gameboy& b)
+{
+    return memcmp(&a.cpu.regs, &b.cpu.regs, sizeof(a.cpu.regs)) == 0 && a.cpu.sp == b.cpu.sp && a.cpu.pc == b.cpu.pc
+           && a.cpu.ime == b.cpu.ime && a.cpu.halted == b.cpu.halted && a.scheduler.now == b.scheduler.now
+           && memcmp(a.memory.ram, b.memory.ram, sizeof(a.memory.ram)) == 0;
+}
+
+static int run(const char* name, Lockstep& lockstep, std::vector<Gameboy>& scalar, uint32_t frames)
+{
+    int failures = 0;
+    for (uint32_t f = 0; f < frames; ++f)
+    {
+        lockstep.run_frame();
+        for (size_t i = 0; i < scalar.size(); ++i)
+        {
+            scalar[i].run_frame();
+            if (!same_state(lockstep.lanes[i], scalar[i]))
+            {
+                printf("%s: lane %zu differs after frame %u\n", name, i, f);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+static Gameboy make_instance(std::shared_ptr<Rom> rom)
+{
+    Gameboy gb;
+    gb.memory.rom = std::move(rom);
+    gb.reset();
+    gb.apu.set_audio(gb, false);
+    return gb;
+}
+
+int main()
+{
+    int failures = 0;
+
+    {
+        // The lane that does not take the branch stays at a lower PC, the other one is demoted
+        auto rom = make_rom({0xfe, 0x00, 0x20, 0x05, 0x05, 0x0d, 0x18, 0xfc, 0x00, 0x1c, 0x18, 0xfd});
+        Lockstep lockstep;
+        std::vector<Gameboy> scalar;
+        for (uint8_t a : {0, 1})
+        {
+            Gameboy gb = make_instance(rom);
+            gb.cpu.regs.a = a;
+            gb.cpu.regs.e = 0;
+            lockstep.add(gb);
+            scalar.push_back(gb);
+        }
+        failures += run("demotion", lockstep, scalar, 4);
+        if (lockstep.stats.demoted_frames == 0)
+        {
+            printf("demotion: no lane was demoted\n");
+            failures++;
+        }
+    }
+
+    std::mt19937 rng(1);
+    for (uint32_t seed = 0; seed < 4; ++seed)
+    {
+        auto rom = make_random_rom(rng);
+        Lockstep lockstep;
+        std::vector<Gameboy> scalar;
+        for (uint8_t i = 0; i < 16; ++i)
+        {
+            Gameboy gb = make_instance(rom);
+            gb.cpu.regs.a = i;
+            gb.cpu.regs.b = i * 3;
+            gb.cpu.regs.f = (i & 0xf) << 4;
+            lockstep.add(gb);
+            scalar.push_back(gb);
+        }
+        failures += run("random", lockstep, scalar, 10);
+    }
+
+    printf("%s\n", failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
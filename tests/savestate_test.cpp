@@ -0,0 +1,114 @@
+// A savestate loaded into another instance continues exactly like the original, and corrupt or truncated states are
+// refused without touching memory outside of them
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "gameboy.h"
+#include "savestate.h"
+
+static bool same_state(const Gameboy& a, const Gameboy& b)
+{
+    return memcmp(&a.cpu.regs, &b.cpu.regs, sizeof(a.cpu.regs)) == 0 && a.cpu.sp == b.cpu.sp && a.cpu.pc == b.cpu.pc
+           && a.scheduler.now == b.scheduler.now && a.ppu.frame_count == b.ppu.frame_count
+           && memcmp(a.memory.ram, b.memory.ram, sizeof(a.memory.ram)) == 0
+           && memcmp(a.ppu.renderer.output.data, b.ppu.renderer.output.data, a.ppu.renderer.output.size()) == 0;
+}
+
+static Gameboy make_instance(std::shared_ptr<Rom> rom)
+{
+    Gameboy gb;
+    gb.memory.rom = std::move(rom);
+    gb.reset();
+    gb.apu.set_audio(gb, false);
+    return gb;
+}
+
+int main()
+{
+    int failures = 0;
+
+    // Counts in A, writes the count to WRAM, VRAM and SCX and sums it in B
+    auto rom = std::make_shared<Rom>();
+    const uint8_t code[] = {0x3c, 0xea, 0x23, 0xc1, 0xea, 0x10, 0x98, 0xe0, 0x43, 0x80, 0x47, 0x18, 0xf3};
+    memcpy(rom->data + 0x100, code, sizeof(code));
+
+    Gameboy original = make_instance(rom);
+    for (int i = 0; i < 3; ++i)
+    {
+        original.run_frame();
+    }
+    for (int i = 0; i < 1000; ++i)
+    {
+        original.step();
+    }
+    std::vector<uint8_t> state;
+    save_state(original, state);
+
+    Gameboy loaded = make_instance(rom);
+    if (!load_state(loaded, state.data(), state.size()))
+    {
+        printf("round trip: the state was refused\n");
+        failures++;
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        original.run_frame();
+        loaded.run_frame();
+        if (!same_state(original, loaded))
+        {
+            printf("round trip: frame %d differs after the load\n", i);
+            failures++;
+        }
+    }
+
+    // Every truncation is refused
+    Gameboy target = make_instance(rom);
+    for (size_t size = 0; size < state.size(); ++size)
+    {
+        std::vector<uint8_t> truncated(state.begin(), state.begin() + size);
+        if (load_state(target, truncated.data(), truncated.size()))
+        {
+            printf("truncated: a state cut at %zu bytes was loaded\n", size);
+            failures++;
+            break;
+        }
+    }
+
+    // Offsets and sizes that point outside of the state, and unknown ids
+    size_t table = sizeof(SaveStateHeader);
+    for (uint64_t offset : {uint64_t(state.size()), UINT64_MAX - 8, UINT64_MAX})
+    {
+        std::vector<uint8_t> corrupt = state;
+        memcpy(corrupt.data() + table + offsetof(SaveStateSection, offset), &offset, sizeof(offset));
+        if (load_state(target, corrupt.data(), corrupt.size()))
+        {
+            printf("corrupt: offset %llu was loaded\n", (unsigned long long)offset);
+            failures++;
+        }
+    }
+    for (uint32_t id : {uint32_t(StateSection::Count), 33u, UINT32_MAX})
+    {
+        std::vector<uint8_t> corrupt = state;
+        memcpy(corrupt.data() + table + offsetof(SaveStateSection, id), &id, sizeof(id));
+        if (load_state(target, corrupt.data(), corrupt.size()))
+        {
+            printf("corrupt: the first section was replaced by id %u and the state was loaded\n", id);
+            failures++;
+        }
+    }
+
+    // Random corruption of the header and the table may be accepted, it must not crash
+    std::mt19937 rng(1);
+    size_t table_end = table + 8 * sizeof(SaveStateSection);
+    for (int i = 0; i < 10000; ++i)
+    {
+        std::vector<uint8_t> corrupt = state;
+        corrupt[rng() % table_end] ^= uint8_t(1 << (rng() % 8));
+        load_state(target, corrupt.data(), corrupt.size());
+    }
+
+    printf("%s\n", failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}